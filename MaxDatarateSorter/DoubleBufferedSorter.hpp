@@ -0,0 +1,151 @@
+#ifndef SCHEDULER_DOUBLEBUFFEREDSORTER_HPP
+#define SCHEDULER_DOUBLEBUFFEREDSORTER_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include "MaxDatarateSorter.hpp"
+
+/**
+ * Two BandSorters, so that one producer thread can build the next TTI's rankings while
+ * any number of reader threads schedule on the last published ones.
+ *
+ * The producer fills back() and calls publish(), which finalizes the back buffer and swaps it to the front
+ * with a single atomic store. Readers acquire() a Snapshot of the front buffer without locking and hold it
+ * while they read. back() blocks until the last reader of the buffer it hands out has released its snapshot;
+ * only that last release takes a lock, to wake the producer.
+ */
+template <class Metric, class Storage = IdRatePairStorage>
+class DoubleBufferedSorter {
+  public:
+    /**
+     * Read-only access to a published sorter. The sorter is not written to while the snapshot is held,
+     * so it should be released before the producer needs that buffer again, i.e. within the TTI.
+     * Published sorters are finalized, so any number of threads can read them at once. A reassignment loop
+     * keeps its own BandSet and calls BandSorter::getBestBand(id, reassigned), as markBand() can't be called.
+     */
+    class Snapshot {
+      public:
+        Snapshot(const DoubleBufferedSorter* owner, const int index) : mOwner(owner), mIndex(index) {}
+        Snapshot(Snapshot&& other) : mOwner(other.mOwner), mIndex(other.mIndex) {
+          other.mOwner = nullptr;
+        }
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+        ~Snapshot() {
+          if (mOwner != nullptr)
+            mOwner->release(mIndex);
+        }
+
+        const BandSorter<Metric, Storage>& operator*() const {
+          return mOwner->buffer(mIndex);
+        }
+        const BandSorter<Metric, Storage>* operator->() const {
+          return &mOwner->buffer(mIndex);
+        }
+
+      private:
+        const DoubleBufferedSorter* mOwner;
+        int mIndex;
+    };
+
+    /**
+     * @param numBands
+     * @param maxPairsPerBand 0 for no limit, see BandSorter.
+     * @param metric
+     */
+    DoubleBufferedSorter(size_t numBands, size_t maxPairsPerBand = 0, const Metric& metric = Metric())
+        : mFirst(numBands, maxPairsPerBand, metric), mSecond(numBands, maxPairsPerBand, metric), mFront(0) {
+      mNumReaders[0] = 0;
+      mNumReaders[1] = 0;
+      mFirst.finalize();
+    }
+    
+    /**
+     * @param numBands
+     * @param maxPairsPerBand 0 for no limit, see BandSorter.
+     * @param storage Given to both buffers, e.g. a CompactStorage with the precision rates are stored at.
+     * @param metric
+     */
+    DoubleBufferedSorter(size_t numBands, size_t maxPairsPerBand, const Storage& storage, const Metric& metric = Metric())
+        : mFirst(numBands, maxPairsPerBand, storage, metric), mSecond(numBands, maxPairsPerBand, storage, metric), mFront(0) {
+      mNumReaders[0] = 0;
+      mNumReaders[1] = 0;
+      mFirst.finalize();
+    }
+
+    /**
+     * Only to be called from the producer thread. Waits until no reader holds a snapshot of the back buffer.
+     * @return The buffer to fill for the next publish(). It still holds what was published two swaps ago.
+     */
+    BandSorter<Metric, Storage>& back() {
+      const int back = 1 - mFront.load();
+      std::unique_lock<std::mutex> lock(mReleaseMutex);
+      mReleased.wait(lock, [this, back]() { return mNumReaders[back].load() == 0; });
+      return buffer(back);
+    }
+
+    /**
+     * Only to be called from the producer thread. Finalizes the back buffer and makes it the front one.
+     * @param numThreads Passed on to BandSorter::finalize().
+     */
+    void publish(const size_t numThreads = 1) {
+      const int back = 1 - mFront.load();
+      buffer(back).finalize(numThreads);
+      mFront.store(back);
+    }
+
+    /**
+     * Can be called from any thread.
+     * @return The last published sorter, held until the snapshot is destroyed.
+     */
+    Snapshot acquire() const {
+      while (true) {
+        const int front = mFront.load();
+        mNumReaders[front].fetch_add(1);
+        // If a publish() came in between, the producer may already be writing to this buffer.
+        if (mFront.load() == front)
+          return Snapshot(this, front);
+        release(front);
+      }
+    }
+
+  private:
+    /**
+     * Drops a reader of buffer 'index' and wakes the producer if it was the last one.
+     * @param index
+     */
+    void release(const int index) const {
+      if (mNumReaders[index].fetch_sub(1) == 1) {
+        // Notifying under the lock, so that back() can't miss it between checking and waiting.
+        std::lock_guard<std::mutex> lock(mReleaseMutex);
+        mReleased.notify_all();
+      }
+    }
+
+    BandSorter<Metric, Storage>& buffer(const int index) {
+      return index == 0 ? mFirst : mSecond;
+    }
+    const BandSorter<Metric, Storage>& buffer(const int index) const {
+      return index == 0 ? mFirst : mSecond;
+    }
+
+    BandSorter<Metric, Storage> mFirst, mSecond;
+    /**
+     * The index of the buffer readers are given.
+     */
+    std::atomic<int> mFront;
+    /**
+     * The number of snapshots held per buffer.
+     */
+    mutable std::atomic<unsigned long> mNumReaders[2];
+    /**
+     * Signalled when the number of readers of a buffer drops to zero.
+     */
+    mutable std::mutex mReleaseMutex;
+    mutable std::condition_variable mReleased;
+};
+
+typedef DoubleBufferedSorter<RateMetric> DoubleBufferedMaxDatarateSorter;
+
+#endif //SCHEDULER_DOUBLEBUFFEREDSORTER_HPP
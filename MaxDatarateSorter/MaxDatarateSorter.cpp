@@ -1,147 +1,903 @@
+#include <algorithm>
+#include <cstdio>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
 #include "MaxDatarateSorter.hpp"
+#include "WorkerPool.hpp"
 
-const std::string dirToA(Direction dir)
-{
-  switch (dir)
-  {
-    case DL:
-      return "DL";
-    case UL:
-      return "UL";
-    case D2D:
-      return "D2D";
-    case D2D_MULTI:
-      return "D2D_MULTI";
-    default:
-      return "Unrecognized";
+namespace {
+  const char* dirToText(const Direction dir) {
+    static const char* const NAMES[] = {"DL", "UL", "D2D", "D2D_MULTI"};
+    return dir >= DL && dir <= D2D_MULTI ? NAMES[dir] : "Unrecognized";
   }
+  
+  /**
+   * The longest text "%f" makes of a double: sign, 309 digits, point and 6 decimals.
+   */
+  const size_t MAX_FIXED_LENGTH = 317;
+  
+  /**
+   * The append* functions write at 'out' and return the position behind what they wrote.
+   */
+  char* appendText(char* out, const char* text) {
+    while (*text != '\0')
+      *out++ = *text++;
+    return out;
+  }
+  
+  char* appendUnsigned(char* out, unsigned long long value) {
+    char digits[20];
+    size_t numDigits = 0;
+    do {
+      digits[numDigits++] = char('0' + value % 10);
+      value /= 10;
+    } while (value > 0);
+    while (numDigits > 0)
+      *out++ = digits[--numDigits];
+    return out;
+  }
+  
+  /**
+   * Formats like std::to_string(double), i.e. printf's "%f". The digits are computed with integer arithmetic unless
+   * the rounding error of scaling by 10^6 could decide how the last digit rounds; then snprintf does it.
+   * Values that are floats, such as stored rates, always take the fast path.
+   */
+  char* appendFixed(char* out, const double value) {
+    const double scaled = std::fabs(value) * 1e6;
+    if (std::isfinite(scaled) && std::fabs(scaled - std::floor(scaled) - 0.5) > std::ldexp(scaled, -52)) {
+      if (std::signbit(value))
+        *out++ = '-';
+      const unsigned long long micros = (unsigned long long) std::nearbyint(scaled);
+      out = appendUnsigned(out, micros / 1000000);
+      *out++ = '.';
+      const unsigned long long fraction = micros % 1000000;
+      for (unsigned long long digit = 100000; digit > 0; digit /= 10)
+        *out++ = char('0' + fraction / digit % 10);
+      return out;
+    }
+    return out + std::snprintf(out, MAX_FIXED_LENGTH + 1, "%f", value);
+  }
+  
+  template <class T>
+  void writeValue(std::ostream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+  
+  template <class T>
+  T readValue(std::istream& in) {
+    T value;
+    if (!in.read(reinterpret_cast<char*>(&value), sizeof(value)))
+      throw std::runtime_error("BandSorter::readBinary reached the end of the input within a record.");
+    return value;
+  }
+  
+  /**
+   * Pairs converted per write or read through a buffer on the stack.
+   */
+  const size_t RECORD_BLOCK_SIZE = 64;
+  
+  IdRatePairRecord toRecord(const IdRatePair& pair) {
+    IdRatePairRecord record;
+    record.rate = pair.rate;
+    record.txPower = pair.txPower;
+    record.connectionId = pair.connectionId;
+    record.from = pair.from;
+    record.to = pair.to;
+    record.dir = uint32_t(pair.dir);
+    record.reserved = 0;
+    return record;
+  }
+  
+  /**
+   * The samePair functions compare the bytes pairs are written as, so that NaN rates compare equal to themselves.
+   */
+  bool samePair(const IdRatePair& a, const IdRatePair& b) {
+    const IdRatePairRecord recordA = toRecord(a), recordB = toRecord(b);
+    return std::memcmp(&recordA, &recordB, sizeof(IdRatePairRecord)) == 0;
+  }
+  
+  bool samePair(const CompactIdRatePair& a, const CompactIdRatePair& b) {
+    return std::memcmp(&a, &b, sizeof(CompactIdRatePair)) == 0;
+  }
+  
+  /**
+   * The writePairs functions write 'numPairs' pairs starting at 'first' as their storage's records.
+   */
+  void writePairs(std::ostream& out, const IdRatePair* first, const size_t numPairs) {
+    IdRatePairRecord records[RECORD_BLOCK_SIZE];
+    for (size_t block = 0; block < numPairs; block += RECORD_BLOCK_SIZE) {
+      const size_t blockSize = std::min(numPairs - block, RECORD_BLOCK_SIZE);
+      for (size_t i = 0; i < blockSize; i++)
+        records[i] = toRecord(first[block + i]);
+      out.write(reinterpret_cast<const char*>(records), blockSize * sizeof(IdRatePairRecord));
+    }
+  }
+  
+  void writePairs(std::ostream& out, const CompactIdRatePair* first, const size_t numPairs) {
+    out.write(reinterpret_cast<const char*>(first), numPairs * sizeof(CompactIdRatePair));
+  }
+  
+  /**
+   * The readPairs functions append 'numPairs' pairs read from their storage's records to 'list',
+   * checking that they are valid.
+   */
+  void readPairs(std::istream& in, std::vector<IdRatePair>& list, const size_t numPairs, const IdRatePairStorage&) {
+    IdRatePairRecord records[RECORD_BLOCK_SIZE];
+    for (size_t block = 0; block < numPairs; block += RECORD_BLOCK_SIZE) {
+      const size_t blockSize = std::min(numPairs - block, RECORD_BLOCK_SIZE);
+      if (!in.read(reinterpret_cast<char*>(records), blockSize * sizeof(IdRatePairRecord)))
+        throw std::runtime_error("BandSorter::readBinary reached the end of the input within a record.");
+      for (size_t i = 0; i < blockSize; i++) {
+        const IdRatePairRecord& record = records[i];
+        if (record.dir > UNKNOWN_DIRECTION || record.reserved != 0)
+          throw std::runtime_error("BandSorter::readBinary read an invalid pair.");
+        list.push_back(IdRatePair(record.connectionId, record.from, record.to, record.txPower, record.rate, Direction(record.dir)));
+      }
+    }
+  }
+  
+  void readPairs(std::istream& in, std::vector<CompactIdRatePair>& list, const size_t numPairs, const CompactStorage& storage) {
+    const size_t first = list.size();
+    list.resize(first + numPairs, CompactIdRatePair());
+    if (!in.read(reinterpret_cast<char*>(list.data() + first), numPairs * sizeof(CompactIdRatePair)))
+      throw std::runtime_error("BandSorter::readBinary reached the end of the input within a record.");
+    const size_t numTxPowers = storage.getCodec().getTxPowers().size();
+    for (size_t i = first; i < list.size(); i++) {
+      if ((list[i].flags & 7) > UNKNOWN_DIRECTION || ((list[i].flags >> 4) & 15) >= numTxPowers || (list[i].flags & ~uint32_t(0xf7)) != 0)
+        throw std::runtime_error("BandSorter::readBinary read an invalid pair.");
+    }
+  }
+  
+  /**
+   * The writeState functions write what a storage needs to read its records back.
+   */
+  void writeState(std::ostream&, const IdRatePairStorage&) {}
+  
+  void writeState(std::ostream& out, const CompactStorage& storage) {
+    writeValue(out, storage.getCodec().getRateResolution());
+    const std::vector<double>& txPowers = storage.getCodec().getTxPowers();
+    writeValue(out, uint8_t(txPowers.size()));
+    out.write(reinterpret_cast<const char*>(txPowers.data()), txPowers.size() * sizeof(double));
+  }
+  
+  /**
+   * The readState functions read what writeState() wrote into 'storage'.
+   * If 'isDelta', pairs kept from the current contents must read the same with the new state.
+   */
+  void readState(std::istream&, IdRatePairStorage&, const bool) {}
+  
+  void readState(std::istream& in, CompactStorage& storage, const bool isDelta) {
+    const double rateResolution = readValue<double>(in);
+    std::vector<double> txPowers(readValue<uint8_t>(in));
+    if (txPowers.size() > PairCodec::MAX_TX_POWERS)
+      throw std::runtime_error("BandSorter::readBinary read more tx powers than a PairCodec can hold.");
+    for (size_t i = 0; i < txPowers.size(); i++)
+      txPowers[i] = readValue<double>(in);
+    if (isDelta) {
+      const PairCodec& codec = storage.getCodec();
+      const std::vector<double>& currentTxPowers = codec.getTxPowers();
+      if (rateResolution != codec.getRateResolution() || txPowers.size() < currentTxPowers.size()
+          || !std::equal(currentTxPowers.begin(), currentTxPowers.end(), txPowers.begin()))
+        throw std::runtime_error("BandSorter::readBinary read a delta for a different codec state.");
+    }
+    storage = CompactStorage(PairCodec(rateResolution, txPowers));
+  }
+}
+
+template <class Metric, class Storage>
+const uint16_t BandSorter<Metric, Storage>::BINARY_FORMAT_VERSION;
+
+template <class Metric, class Storage>
+BandSorter<Metric, Storage>::BandSorter(size_t numBands, const Metric& metric) : BandSorter(numBands, 0, metric) {}
+
+template <class Metric, class Storage>
+BandSorter<Metric, Storage>::BandSorter(size_t numBands, size_t maxPairsPerBand, const Metric& metric) : BandSorter(numBands, maxPairsPerBand, Storage(), metric) {}
+
+template <class Metric, class Storage>
+BandSorter<Metric, Storage>::BandSorter(size_t numBands, size_t maxPairsPerBand, const Storage& storage, const Metric& metric)
+  : mMetric(metric), mStorage(storage), mNumSorted(numBands, 0), mSortBuffer(maxPairsPerBand), mRanks(numBands), mSequence(0), mGeneration(0), mReassignedBands(numBands),
+    mUnmarkCount(0), mNumBands(numBands), mMaxPairsPerBand(maxPairsPerBand) {
+  for (size_t i = 0; i < numBands; i++) {
+    mBandToIdRate.push_back(std::vector<typename Storage::Stored>());
+    mBandToIdRate.at(i).reserve(maxPairsPerBand);
+    mRanks.at(i).reserve(maxPairsPerBand);
+  }
+}
+
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::put(const Band &band, const IdRatePair& idRatePair) {
+  std::vector<typename Storage::Stored>& list = mBandToIdRate.at(band);
+  if (mMaxPairsPerBand > 0 && list.size() == mMaxPairsPerBand)
+    throw std::length_error("BandSorter::put called on band " + std::to_string(band) + " which already holds the maximum of " + std::to_string(mMaxPairsPerBand) + " pairs.");
+  // Just append, sorting is deferred until the band is read.
+  list.push_back(mStorage.encode(idRatePair));
+  // Remember where this node's pair went.
+  NodeEntry& entry = getEntry(idRatePair.from);
+  entry.bands.set(band, true);
+  numPairs(entry)[band]++;
+  // The key of the pair as stored. It is computed only here, sorting compares the band's key column.
+  const RankKey rank(keyOf(list.back()), mSequence++);
+  mRanks.at(band).push_back(rank);
+  // Being put last, the pair ranks first among those of the node with an equal key.
+  const double bestKey = bestKeys(entry)[band];
+  if (rank.key >= bestKey) {
+    if (rank.key > bestKey)
+      entry.rankingValid = false;
+    setBestRank(entry, band, rank);
+  }
+}
+
+template <class Metric, class Storage>
+const typename BandSorter<Metric, Storage>::NodeEntry* BandSorter<Metric, Storage>::findEntry(const MacNodeId &id) const {
+  typename NodeIndex::const_iterator it = mNodeIndex.find(id);
+  if (it == mNodeIndex.end() || it->second.generation != mGeneration)
+    return nullptr;
+  return &it->second;
+}
+
+template <class Metric, class Storage>
+typename BandSorter<Metric, Storage>::NodeEntry* BandSorter<Metric, Storage>::findEntry(const MacNodeId &id) {
+  return const_cast<NodeEntry*>(static_cast<const BandSorter<Metric, Storage>&>(*this).findEntry(id));
+}
+
+template <class Metric, class Storage>
+typename BandSorter<Metric, Storage>::NodeEntry& BandSorter<Metric, Storage>::getEntry(const MacNodeId &id) {
+  typename NodeIndex::iterator it = mNodeIndex.find(id);
+  if (it == mNodeIndex.end()) {
+    it = mNodeIndex.insert(std::make_pair(id, NodeEntry(mNumBands, mNodeIndex.size()))).first;
+    mBestKeys.resize(mNodeIndex.size() * mNumBands);
+    mBestSequences.resize(mNodeIndex.size() * mNumBands);
+    mNumPairs.resize(mNodeIndex.size() * mNumBands);
+    // Empties the new entry below.
+    it->second.generation = mGeneration - 1;
+  }
+  NodeEntry& entry = it->second;
+  if (entry.generation != mGeneration) {
+    entry.bands.reset();
+    std::fill(bestKeys(entry), bestKeys(entry) + mNumBands, -std::numeric_limits<double>::infinity());
+    std::fill(bestSequences(entry), bestSequences(entry) + mNumBands, 0);
+    std::fill(numPairs(entry), numPairs(entry) + mNumBands, 0);
+    entry.rankingValid = false;
+    entry.generation = mGeneration;
+  }
+  return entry;
+}
+
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::finalize(const size_t numThreads) {
+  if (numThreads <= 1 || mNumBands <= 1) {
+    for (Band band(0); band < mNumBands; band++)
+      flush(band);
+    rankAll();
+  } else {
+    WorkerPool pool(std::min(numThreads, mNumBands));
+    finalize(pool);
+  }
+}
+
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::finalize(WorkerPool& pool) {
+  while (mWorkerBuffers.size() < pool.size())
+    mWorkerBuffers.push_back(SortBuffer(mMaxPairsPerBand));
+  // Bands are independent and flushing one doesn't depend on the thread doing it.
+  pool.run(mNumBands, [this](size_t band, size_t thread) {
+    flush(Band(band), mWorkerBuffers[thread]);
+  });
+  rankAll();
+}
+
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::rankAll() const {
+  // Rank every node's bands now, so that reading doesn't change anything until the container is changed.
+  for (typename NodeIndex::const_iterator it = mNodeIndex.begin(); it != mNodeIndex.end(); ++it) {
+    if (it->second.generation == mGeneration)
+      rank(it->second);
+  }
+}
+
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::clear() {
+  for (size_t i = 0; i < mBandToIdRate.size(); i++) {
+    mBandToIdRate.at(i).clear();
+    mNumSorted.at(i) = 0;
+    mRanks.at(i).clear();
+  }
+  mReassignedBands.reset();
+  // Empties all node entries at once.
+  mGeneration++;
+}
+
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::flush(const Band &band) const {
+  flush(band, mSortBuffer);
+}
+
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::flush(const Band &band, SortBuffer& buffer) const {
+  std::vector<typename Storage::Stored>& list = mBandToIdRate.at(band);
+  std::vector<RankKey>& ranks = mRanks.at(band);
+  const size_t numSorted = mNumSorted.at(band);
+  if (numSorted == list.size())
+    return;
+  const size_t numPending = list.size() - numSorted;
+  // Ranks are unique, so the pending pairs' order doesn't depend on the sort being stable.
+  buffer.order.clear();
+  for (size_t i = numSorted; i < list.size(); i++)
+    buffer.order.push_back(RankedPosition(ranks[i], i));
+  std::sort(buffer.order.begin(), buffer.order.end(), RankGreater());
+  buffer.pairs.clear();
+  for (size_t i = 0; i < numPending; i++)
+    buffer.pairs.push_back(list[buffer.order[i].position]);
+  // Merge from the back, so that only the pending pairs are copied aside.
+  size_t sorted = numSorted, pending = numPending, target = list.size();
+  while (pending > 0) {
+    target--;
+    if (sorted > 0 && !(ranks[sorted - 1] > buffer.order[pending - 1].rank)) {
+      sorted--;
+      list[target] = list[sorted];
+      ranks[target] = ranks[sorted];
+    } else {
+      pending--;
+      list[target] = buffer.pairs[pending];
+      ranks[target] = buffer.order[pending].rank;
+    }
+  }
+  mNumSorted.at(band) = list.size();
+}
+
+template <class Metric, class Storage>
+typename Storage::List BandSorter<Metric, Storage>::at(const Band &band) const {
+  flush(band);
+  return mStorage.list(mBandToIdRate.at(band));
+}
+
+template <class Metric, class Storage>
+typename BandSorter<Metric, Storage>::DirectionView BandSorter<Metric, Storage>::at(const Band &band, const Direction &dir) const {
+  flush(band);
+  const std::vector<typename Storage::Stored>& allPairs = mBandToIdRate.at(band);
+  return DirectionView(allPairs.data(), &mStorage, allPairs.size(), dir, false);
+}
+
+template <class Metric, class Storage>
+typename BandSorter<Metric, Storage>::DirectionView BandSorter<Metric, Storage>::at_nonD2D(const Band &band) const {
+  flush(band);
+  const std::vector<typename Storage::Stored>& allPairs = mBandToIdRate.at(band);
+  return DirectionView(allPairs.data(), &mStorage, allPairs.size(), Direction::D2D, true);
+}
+
+template <class Metric, class Storage>
+size_t BandSorter<Metric, Storage>::countAtLeast(const Band &band, const double minKey) const {
+  const std::vector<RankKey>& ranks = mRanks.at(band);
+  const auto isBefore = [](const double minKey, const RankKey& rank) { return minKey > rank.key; };
+  return std::upper_bound(ranks.begin(), ranks.end(), minKey, isBefore) - ranks.begin();
+}
+
+template <class Metric, class Storage>
+typename BandSorter<Metric, Storage>::PairRange BandSorter<Metric, Storage>::range(const Band &band, const double minKey) const {
+  flush(band);
+  const std::vector<typename Storage::Stored>& allPairs = mBandToIdRate.at(band);
+  return PairRange(allPairs.data(), allPairs.data() + countAtLeast(band, minKey), &mStorage);
+}
+
+template <class Metric, class Storage>
+typename BandSorter<Metric, Storage>::DirectionView BandSorter<Metric, Storage>::range(const Band &band, const double minKey, const Direction &dir) const {
+  flush(band);
+  const std::vector<typename Storage::Stored>& allPairs = mBandToIdRate.at(band);
+  return DirectionView(allPairs.data(), &mStorage, countAtLeast(band, minKey), dir, false);
+}
+
+template <class Metric, class Storage>
+typename Storage::Reference BandSorter<Metric, Storage>::get(const Band& band, const size_t& position) const {
+  flush(band);
+  return mStorage.decode(mBandToIdRate.at(band).at(position));
+}
+
+template <class Metric, class Storage>
+std::string BandSorter<Metric, Storage>::toString() const {
+  std::ostringstream out;
+  write(out);
+  return out.str();
 }
 
-MaxDatarateSorter::MaxDatarateSorter(size_t numBands) : mNumBands(numBands) {
-  for (size_t i = 0; i < numBands; i++)
-    mBandToIdRate.push_back(std::vector<IdRatePair>());
+template <class Metric, class Storage>
+std::string BandSorter<Metric, Storage>::toString(std::string prefix) const {
+  std::ostringstream out;
+  out << '\n';
+  write(out, prefix);
+  return out.str();
 }
 
-void MaxDatarateSorter::put(const Band &band, const IdRatePair& idRatePair) {
-  // Grab the band's vector.
-  std::vector<IdRatePair>& list = mBandToIdRate.at(band);
-  // Go through list.
-  for (size_t i = 0; i < list.size(); i++) {
-    IdRatePair current = list.at(i);
-    // Is the given rate better than the one at this position?
-    if (current < idRatePair) {
-      // Then insert this one before it.
-      list.insert(list.begin() + i, idRatePair);
-      return;
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::write(std::ostream &out, const std::string &prefix) const {
+  // Long enough for a line with the longest direction and numbers, without the prefix.
+  char line[2 * MAX_FIXED_LENGTH + 64];
+  for (Band band(0); band < mNumBands; band++) {
+    out.write(prefix.data(), prefix.size());
+    char* end = appendText(line, "Band ");
+    end = appendUnsigned(end, band);
+    end = appendText(end, ":\n");
+    out.write(line, end - line);
+    flush(band);
+    const std::vector<typename Storage::Stored>& list = mBandToIdRate.at(band);
+    for (size_t i = 0; i < list.size(); i++) {
+      const IdRatePair& pair = mStorage.decode(list[i]);
+      out.write(prefix.data(), prefix.size());
+      end = appendText(line, "\t");
+      end = appendUnsigned(end, pair.from);
+      end = appendText(end, "-");
+      end = appendText(end, dirToText(pair.dir));
+      end = appendText(end, "->");
+      end = appendUnsigned(end, pair.to);
+      end = appendText(end, " @");
+      end = appendFixed(end, pair.txPower);
+      end = appendText(end, " with throughput ");
+      end = appendFixed(end, pair.rate);
+      end = appendText(end, "\n");
+      out.write(line, end - line);
     }
   }
-  // The new value must have a worse rate than every list member, so put it at the back.
-  list.push_back(idRatePair);
 }
 
-const std::vector<IdRatePair>& MaxDatarateSorter::at(const Band &band) const {
-  return mBandToIdRate.at(band);
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::writeHeader(std::ostream &out) const {
+  writeValue(out, BINARY_FORMAT_VERSION);
+  writeValue(out, uint16_t(mNumBands));
+  writeValue(out, uint8_t(Storage::BINARY_ID));
+  writeState(out, mStorage);
 }
 
-const std::vector<IdRatePair> MaxDatarateSorter::at(const Band &band, const Direction &dir) const {
-  std::vector<IdRatePair> allPairs = mBandToIdRate.at(band);
-  for (std::vector<IdRatePair>::iterator it = allPairs.begin(); it < allPairs.end(); it++) {
-    IdRatePair& pair = *it;
-    if (pair.dir != dir) {
-      allPairs.erase(it);
-      // Size has decreased by one, so decrease 'it' in order to target next element correctly.
-      it--;
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::writeBinary(std::ostream &out) const {
+  out.write("MDRS", 4);
+  writeHeader(out);
+  for (Band band(0); band < mNumBands; band++) {
+    flush(band);
+    const std::vector<typename Storage::Stored>& list = mBandToIdRate.at(band);
+    writeValue(out, uint32_t(list.size()));
+    writePairs(out, list.data(), list.size());
+  }
+  for (size_t i = 0; i < mReassignedBands.numWords(); i++)
+    writeValue(out, mReassignedBands.word(i));
+}
+
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::writeBinaryDelta(std::ostream &out) {
+  if (mLastWritten.empty()) {
+    writeBinary(out);
+  } else {
+    // Per changed band: the band and how many pairs are kept from the front and the back.
+    std::vector<size_t> changes;
+    for (Band band(0); band < mNumBands; band++) {
+      flush(band);
+      const std::vector<typename Storage::Stored>& current = mBandToIdRate.at(band);
+      const std::vector<typename Storage::Stored>& last = mLastWritten.at(band);
+      const size_t shorter = std::min(current.size(), last.size());
+      size_t front = 0, back = 0;
+      while (front < shorter && samePair(current[front], last[front]))
+        front++;
+      while (back < shorter - front && samePair(current[current.size() - 1 - back], last[last.size() - 1 - back]))
+        back++;
+      if (current.size() == last.size() && front == current.size())
+        continue;
+      changes.push_back(band);
+      changes.push_back(front);
+      changes.push_back(back);
     }
+    out.write("MDRD", 4);
+    writeHeader(out);
+    writeValue(out, uint16_t(changes.size() / 3));
+    for (size_t i = 0; i < changes.size(); i += 3) {
+      const std::vector<typename Storage::Stored>& current = mBandToIdRate.at(changes[i]);
+      const size_t front = changes[i + 1], back = changes[i + 2];
+      writeValue(out, uint16_t(changes[i]));
+      writeValue(out, uint32_t(front));
+      writeValue(out, uint32_t(back));
+      writeValue(out, uint32_t(current.size() - front - back));
+      writePairs(out, current.data() + front, current.size() - front - back);
+    }
+    for (size_t i = 0; i < mReassignedBands.numWords(); i++)
+      writeValue(out, mReassignedBands.word(i));
+  }
+  mLastWritten.resize(mNumBands);
+  for (Band band(0); band < mNumBands; band++)
+    mLastWritten.at(band).assign(mBandToIdRate.at(band).begin(), mBandToIdRate.at(band).end());
+}
+
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::readHeader(std::istream &in, const bool isDelta) {
+  const uint16_t version = readValue<uint16_t>(in);
+  if (version != BINARY_FORMAT_VERSION)
+    throw std::runtime_error("BandSorter::readBinary can't read format version " + std::to_string(version));
+  const uint16_t numBands = readValue<uint16_t>(in);
+  if (numBands != mNumBands)
+    throw std::runtime_error("BandSorter::readBinary called with " + std::to_string(numBands) + " bands for a container of " + std::to_string(mNumBands));
+  if (readValue<uint8_t>(in) != Storage::BINARY_ID)
+    throw std::runtime_error("BandSorter::readBinary read a record of a different storage.");
+  readState(in, mStorage, isDelta);
+}
+
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::readBinary(std::istream &in) {
+  char magic[4];
+  if (!in.read(magic, 4))
+    throw std::runtime_error("BandSorter::readBinary reached the end of the input within a record.");
+  const bool isDelta = std::memcmp(magic, "MDRD", 4) == 0;
+  if (!isDelta && std::memcmp(magic, "MDRS", 4) != 0)
+    throw std::runtime_error("BandSorter::readBinary didn't find a record.");
+  try {
+    readRecord(in, isDelta);
+  } catch (...) {
+    // A partly read record leaves lists and ranks out of step, e.g. the last record of a log cut off by a crash.
+    clear();
+    throw;
   }
-  return allPairs;
 }
 
-const std::vector<IdRatePair> MaxDatarateSorter::at_nonD2D(const Band &band) const {
-  std::vector<IdRatePair> allPairs = mBandToIdRate.at(band);
-  for (std::vector<IdRatePair>::iterator it = allPairs.begin(); it < allPairs.end(); it++) {
-    IdRatePair& pair = *it;
-    if (pair.dir == Direction::D2D) {
-      allPairs.erase(it);
-      // Size has decreased by one, so decrease 'it' in order to target next element correctly.
-      it--;
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::readRecord(std::istream &in, const bool isDelta) {
+  if (isDelta) {
+    for (Band band(0); band < mNumBands; band++)
+      flush(band);
+  } else {
+    clear();
+  }
+  readHeader(in, isDelta);
+  if (isDelta) {
+    const uint16_t numChanged = readValue<uint16_t>(in);
+    for (size_t i = 0; i < numChanged; i++) {
+      const uint16_t band = readValue<uint16_t>(in);
+      const uint32_t front = readValue<uint32_t>(in), back = readValue<uint32_t>(in), numPairs = readValue<uint32_t>(in);
+      if (band >= mNumBands || size_t(front) + back > mBandToIdRate.at(band).size())
+        throw std::runtime_error("BandSorter::readBinary read a delta that doesn't match the current contents.");
+      std::vector<typename Storage::Stored>& list = mBandToIdRate.at(band);
+      if (mMaxPairsPerBand > 0 && size_t(front) + back + numPairs > mMaxPairsPerBand)
+        throw std::length_error("BandSorter::readBinary would put more than the maximum of " + std::to_string(mMaxPairsPerBand) + " pairs on band " + std::to_string(band));
+      // Only the kept pairs are copied aside, so that the list keeps its memory.
+      mSortBuffer.pairs.assign(list.end() - back, list.end());
+      list.erase(list.begin() + front, list.end());
+      readPairs(in, list, numPairs, mStorage);
+      list.insert(list.end(), mSortBuffer.pairs.begin(), mSortBuffer.pairs.end());
+    }
+  } else {
+    for (Band band(0); band < mNumBands; band++) {
+      const uint32_t numPairs = readValue<uint32_t>(in);
+      if (mMaxPairsPerBand > 0 && numPairs > mMaxPairsPerBand)
+        throw std::length_error("BandSorter::readBinary would put more than the maximum of " + std::to_string(mMaxPairsPerBand) + " pairs on band " + std::to_string(band));
+      std::vector<typename Storage::Stored>& list = mBandToIdRate.at(band);
+      readPairs(in, list, numPairs, mStorage);
     }
   }
-  return allPairs;
+  for (size_t i = 0; i < mReassignedBands.numWords(); i++)
+    mReassignedBands.setWord(i, readValue<uint64_t>(in));
+  // Marked bands may have become unmarked.
+  mUnmarkCount++;
+  for (Band band(0); band < mNumBands; band++) {
+    computeRanks(band);
+    mNumSorted.at(band) = mBandToIdRate.at(band).size();
+  }
+  rebuildIndex();
 }
 
-const IdRatePair& MaxDatarateSorter::get(const Band& band, const size_t& position) const {
-  return at(band).at(position);
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::setMetric(const Metric &metric) {
+  mMetric = metric;
+  for (Band band(0); band < mNumBands; band++) {
+    computeRanks(band);
+    // Sorts the whole band as if all its pairs were pending.
+    mNumSorted.at(band) = 0;
+    flush(band);
+  }
+  // Starts a new generation, so that every node's best ranks and ranking are built anew.
+  rebuildIndex();
 }
 
-std::string MaxDatarateSorter::toString() const {
-  std::string descr = "";
-  for (size_t i = 0; i < mBandToIdRate.size(); i++) {
-    descr += "Band " + std::to_string(i) + ":\n";
-    for (size_t j = 0; j < mBandToIdRate.at(i).size(); j++) {
-      const IdRatePair& pair = mBandToIdRate.at(i).at(j);
-      descr += "\t" + std::to_string(pair.from) + "-" + dirToA(pair.dir) + "->" + std::to_string(pair.to) + " @" + std::to_string(pair.txPower) + " with throughput " + std::to_string(pair.rate) + "\n";
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::computeRanks(const Band &band) {
+  const std::vector<typename Storage::Stored>& list = mBandToIdRate.at(band);
+  std::vector<RankKey>& ranks = mRanks.at(band);
+  ranks.clear();
+  // Pairs in front rank first among equal keys, as if they were put later.
+  for (size_t i = 0; i < list.size(); i++)
+    ranks.push_back(RankKey(keyOf(list[i]), mSequence + list.size() - 1 - i));
+  mSequence += list.size();
+}
+
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::rebuildIndex() {
+  mGeneration++;
+  for (Band band(0); band < mNumBands; band++) {
+    const std::vector<typename Storage::Stored>& list = mBandToIdRate.at(band);
+    const std::vector<RankKey>& ranks = mRanks.at(band);
+    for (size_t i = 0; i < list.size(); i++) {
+      if (i > 0 && ranks[i].key > ranks[i - 1].key)
+        throw std::runtime_error("BandSorter::readBinary read a band that isn't sorted according to this container's metric.");
+      NodeEntry& entry = getEntry(list[i].from);
+      entry.bands.set(band, true);
+      numPairs(entry)[band]++;
+      if (ranks[i].key > bestKeys(entry)[band])
+        setBestRank(entry, band, ranks[i]);
     }
   }
-  return descr;
 }
 
-std::string MaxDatarateSorter::toString(std::string prefix) const {
-  std::string descr = "\n";
-  for (size_t i = 0; i < mBandToIdRate.size(); i++) {
-    descr += prefix + "Band " + std::to_string(i) + ":\n";
-    for (size_t j = 0; j < mBandToIdRate.at(i).size(); j++) {
-      const IdRatePair& pair = mBandToIdRate.at(i).at(j);
-      descr += prefix + "\t" + std::to_string(pair.from) + "-" + dirToA(pair.dir) + "->" + std::to_string(pair.to) + " @" + std::to_string(pair.txPower) + " with throughput " + std::to_string(pair.rate) + "\n";
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::remove(const MacNodeId id) {
+  NodeEntry* entry = findEntry(id);
+  if (entry == nullptr)
+    return;
+  // Bands are not sorted for this: the sorted part stays sorted and the pending pairs keep their order.
+  for (Band band(0); band < mNumBands; band++) {
+    if (numPairs(*entry)[band] == 0)
+      continue;
+    std::vector<typename Storage::Stored>& currentBandVec = mBandToIdRate.at(band);
+    std::vector<RankKey>& ranks = mRanks.at(band);
+    const size_t numSorted = mNumSorted.at(band);
+    // All of the node's sorted pairs are ranked at or behind its best one, so start looking there.
+    const size_t first = std::lower_bound(ranks.begin(), ranks.begin() + numSorted, bestRank(*entry, band), std::greater<RankKey>()) - ranks.begin();
+    // Close the gaps, moving each pair together with its rank.
+    size_t kept = first, numRemovedSorted = 0;
+    for (size_t i = first; i < currentBandVec.size(); i++) {
+      if (currentBandVec[i].from != id) {
+        currentBandVec[kept] = currentBandVec[i];
+        ranks[kept] = ranks[i];
+        kept++;
+      } else if (i < numSorted) {
+        numRemovedSorted++;
+      }
     }
+    currentBandVec.erase(currentBandVec.begin() + kept, currentBandVec.end());
+    ranks.erase(ranks.begin() + kept, ranks.end());
+    mNumSorted.at(band) = numSorted - numRemovedSorted;
   }
-  return descr;
+  // Empties the entry, as if it was never put.
+  entry->generation = mGeneration - 1;
 }
 
-void MaxDatarateSorter::remove(const MacNodeId id) {
-  for (size_t i = 0; i < mBandToIdRate.size(); i++) {
-    std::vector<IdRatePair>& currentBandVec = mBandToIdRate.at(i);
-    for (size_t j = 0; j < currentBandVec.size(); j++) {
-      if (currentBandVec.at(j).from == id)
-        currentBandVec.erase(currentBandVec.begin() + j);
+template <class Metric, class Storage>
+size_t BandSorter<Metric, Storage>::findPair(const Band &band, const MacNodeId &from) const {
+  const std::vector<RankKey>& ranks = mRanks.at(band);
+  return std::lower_bound(ranks.begin(), ranks.end(), bestRank(*findEntry(from), band), std::greater<RankKey>()) - ranks.begin();
+}
+
+template <class Metric, class Storage>
+size_t BandSorter<Metric, Storage>::rankOf(const Band &band, const MacNodeId &id) const {
+  if (!hasPair(id, band))
+    throw std::invalid_argument("BandSorter::rankOf called for node " + std::to_string(id) + " without a pair on band " + std::to_string(band));
+  flush(band);
+  return findPair(band, id);
+}
+
+template <class Metric, class Storage>
+bool BandSorter<Metric, Storage>::hasPair(const MacNodeId &from, const Band &band) const {
+  const NodeEntry* entry = findEntry(from);
+  return band < mNumBands && entry != nullptr && numPairs(*entry)[band] > 0;
+}
+
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::updateRate(const Band &band, const MacNodeId &from, const double rate) {
+  if (!hasPair(from, band))
+    throw std::invalid_argument("BandSorter::updateRate called for node " + std::to_string(from) + " without a pair on band " + std::to_string(band));
+  flush(band);
+  std::vector<typename Storage::Stored>& list = mBandToIdRate.at(band);
+  std::vector<RankKey>& ranks = mRanks.at(band);
+  const size_t position = findPair(band, from);
+  const RankKey oldRank = ranks.at(position);
+  mStorage.setRate(list.at(position), rate);
+  // The pair goes in front of those with an equal key, like a pair that was just put.
+  const RankKey rank(keyOf(list.at(position)), mSequence++);
+  ranks.at(position) = rank;
+  size_t newPosition;
+  if (rank > oldRank) {
+    // Move up in front of the first pair that isn't better.
+    newPosition = std::lower_bound(ranks.begin(), ranks.begin() + position, rank, std::greater<RankKey>()) - ranks.begin();
+    std::rotate(list.begin() + newPosition, list.begin() + position, list.begin() + position + 1);
+    std::rotate(ranks.begin() + newPosition, ranks.begin() + position, ranks.begin() + position + 1);
+  } else {
+    // Move down behind the last pair that is better.
+    const size_t end = std::lower_bound(ranks.begin() + position + 1, ranks.end(), rank, std::greater<RankKey>()) - ranks.begin();
+    std::rotate(list.begin() + position, list.begin() + position + 1, list.begin() + end);
+    std::rotate(ranks.begin() + position, ranks.begin() + position + 1, ranks.begin() + end);
+    newPosition = end - 1;
+  }
+  NodeEntry* entry = findEntry(from);
+  const double oldBestKey = bestKeys(*entry)[band];
+  if (numPairs(*entry)[band] == 1) {
+    setBestRank(*entry, band, ranks[newPosition]);
+  } else {
+    // Another pair of 'from' may be its best one now.
+    const auto isNodes = [from](const typename Storage::Stored& pair) { return pair.from == from; };
+    setBestRank(*entry, band, ranks.at(std::find_if(list.begin(), list.end(), isNodes) - list.begin()));
+  }
+  if (bestKeys(*entry)[band] != oldBestKey)
+    entry->rankingValid = false;
+}
+
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::updateRates(const std::vector<RateUpdate> &updates) {
+  for (size_t i = 0; i < updates.size(); i++) {
+    const RateUpdate& update = updates.at(i);
+    if (!hasPair(update.from, update.band))
+      throw std::invalid_argument("BandSorter::updateRates called for node " + std::to_string(update.from) + " without a pair on band " + std::to_string(update.band));
+    // Throws for a rate the storage can't store.
+    mStorage.checkRate(update.rate);
+  }
+  for (size_t i = 0; i < updates.size(); i++)
+    updateRate(updates.at(i).band, updates.at(i).from, updates.at(i).rate);
+}
+
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::markBand(const Band &band, const bool reassigned) {
+  if (band >= mNumBands)
+    throw std::out_of_range("BandSorter::markBand called for band " + std::to_string(band) + " of a container of " + std::to_string(mNumBands) + " bands.");
+  if (!reassigned && mReassignedBands.test(band))
+    mUnmarkCount++;
+  mReassignedBands.set(band, reassigned);
+}
+
+template <class Metric, class Storage>
+bool BandSorter<Metric, Storage>::isReassigned(const Band &band) const {
+  if (band >= mNumBands)
+    throw std::out_of_range("BandSorter::isReassigned called for band " + std::to_string(band) + " of a container of " + std::to_string(mNumBands) + " bands.");
+  return mReassignedBands.test(band);
+}
+
+template <class Metric, class Storage>
+typename BandSorter<Metric, Storage>::GlobalIterator BandSorter<Metric, Storage>::globalBegin() const {
+  for (Band band(0); band < mNumBands; band++)
+    flush(band);
+  return GlobalIterator(*this);
+}
+
+template <class Metric, class Storage>
+std::vector<std::pair<Band, IdRatePair>> BandSorter<Metric, Storage>::topK(const size_t k) const {
+  std::vector<std::pair<Band, IdRatePair>> best;
+  for (GlobalIterator it = globalBegin(); best.size() < k && it != globalEnd(); ++it)
+    best.push_back(std::make_pair(it.band(), *it));
+  return best;
+}
+
+template <class Metric, class Storage>
+void BandSorter<Metric, Storage>::rank(const NodeEntry& entry) const {
+  // Rank the node's bands if its rates changed.
+  if (!entry.rankingValid) {
+    entry.ranking.clear();
+    for (Band band(0); band < mNumBands; band++) {
+      if (entry.bands.test(band))
+        entry.ranking.push_back(band);
     }
+    // Best key first, among equally good bands the lowest one. The tie-break makes the order unique,
+    // so std::sort gives the same ranking as a stable sort in O(B log B) without allocating.
+    const double* bestKey = bestKeys(entry);
+    std::sort(entry.ranking.begin(), entry.ranking.end(), [bestKey](const Band a, const Band b) {
+      return bestKey[a] > bestKey[b] || (bestKey[a] == bestKey[b] && a < b);
+    });
+    entry.rankingValid = true;
+    entry.next = 0;
+  }
+  // Skipped bands may have become available again.
+  if (entry.unmarkCount != mUnmarkCount) {
+    entry.next = 0;
+    entry.unmarkCount = mUnmarkCount;
   }
+  while (entry.next < entry.ranking.size() && mReassignedBands.test(entry.ranking[entry.next]))
+    entry.next++;
 }
 
-void MaxDatarateSorter::markBand(const Band &band, const bool reassigned) {
-  // Grab all <id, rate> pairs.
-  std::vector<IdRatePair>& ratesVec = mBandToIdRate.at(band);
-  for (size_t i = 0; i < ratesVec.size(); i++) {
-    IdRatePair& item = ratesVec.at(i);
-    item.reassigned = reassigned;
+template <class Metric, class Storage>
+bool BandSorter<Metric, Storage>::tryGetBestBand(const MacNodeId& id, Band& band) const {
+  const NodeEntry* entry = findEntry(id);
+  if (entry == nullptr)
+    return false;
+  rank(*entry);
+  if (entry->next == entry->ranking.size())
+    return false;
+  band = entry->ranking[entry->next];
+  return true;
+}
+
+template <class Metric, class Storage>
+const Band BandSorter<Metric, Storage>::getBestBand(const MacNodeId& id) const {
+  Band band;
+  if (!tryGetBestBand(id, band))
+    throw std::runtime_error("BandSorter::getBestBand called but no bands available.");
+  return band;
+}
+
+template <class Metric, class Storage>
+bool BandSorter<Metric, Storage>::tryGetBestBand(const MacNodeId& id, const BandSet& reassigned, Band& band) const {
+  if (reassigned.numWords() < mReassignedBands.numWords())
+    throw std::invalid_argument("BandSorter::getBestBand called with a BandSet of fewer bands than the container's.");
+  const NodeEntry* entry = findEntry(id);
+  if (entry == nullptr)
+    return false;
+  if (entry->rankingValid) {
+    // The bands before the cursor are marked, unless a band was unmarked since it was advanced.
+    for (size_t i = entry->unmarkCount == mUnmarkCount ? entry->next : 0; i < entry->ranking.size(); i++) {
+      if (!mReassignedBands.test(entry->ranking[i]) && !reassigned.test(entry->ranking[i])) {
+        band = entry->ranking[i];
+        return true;
+      }
+    }
+    return false;
   }
+  return findBestBand(*entry, reassigned, band);
 }
 
-const Band MaxDatarateSorter::getBestBand(const MacNodeId& id) const {
-  Band bestBand(0);
-  double bestRate = -1;
-  // Go through all bands.
-  for (Band band(0); band < mNumBands; band++) {
-    // Grab all <id, rate> pairs.
-    const std::vector<IdRatePair>& ratesVec = at(band);
-    // Find the right pair.
-    for (size_t i = 0; i < ratesVec.size(); i++) {
-      const IdRatePair& item = ratesVec.at(i);
-      // Ignore already reassigned bands.
-      if (item.reassigned)
-        continue;
-      if (item.from == id) {
-        // Is this the best rate yet?
-        if (item.rate > bestRate) {
-          bestBand = band;
-          bestRate = item.rate;
-        }
-        // Stop looking for this band.
-        break;
+template <class Metric, class Storage>
+bool BandSorter<Metric, Storage>::findBestBand(const NodeEntry& entry, const BandSet& reassigned, Band& band) const {
+  const double* bestKey = bestKeys(entry);
+  const double none = -std::numeric_limits<double>::infinity();
+  // Each lane keeps the best key of every LANES-th band. Unavailable bands read as 'none' instead of
+  // being skipped, so that the loop has no branches and can be kept in vector registers.
+  double laneKeys[LANES];
+  size_t laneBands[LANES];
+  std::fill(laneKeys, laneKeys + LANES, none);
+  std::fill(laneBands, laneBands + LANES, mNumBands);
+  size_t firstAvailable = mNumBands;
+  for (size_t word = 0; word < entry.bands.numWords(); word++) {
+    const uint64_t available = entry.bands.word(word) & ~mReassignedBands.word(word) & ~reassigned.word(word);
+    if (available == 0)
+      continue;
+    const size_t first = word * BandSet::BITS_PER_WORD, end = std::min(first + BandSet::BITS_PER_WORD, mNumBands);
+    firstAvailable = std::min(firstAvailable, first + size_t(__builtin_ctzll(available)));
+    size_t candidate = first;
+    for (; candidate + LANES <= end; candidate += LANES) {
+      for (size_t lane = 0; lane < LANES; lane++) {
+        const double key = (available >> (candidate + lane - first)) & 1 ? bestKey[candidate + lane] : none;
+        const bool better = key > laneKeys[lane];
+        laneKeys[lane] = better ? key : laneKeys[lane];
+        laneBands[lane] = better ? candidate + lane : laneBands[lane];
       }
     }
+    // The remainder of the last word.
+    for (size_t lane = 0; candidate < end; candidate++, lane++) {
+      if ((available >> (candidate - first)) & 1 && bestKey[candidate] > laneKeys[lane]) {
+        laneKeys[lane] = bestKey[candidate];
+        laneBands[lane] = candidate;
+      }
+    }
+  }
+  if (firstAvailable == mNumBands)
+    return false;
+  // Among equally good bands the lowest one, as in the ranking.
+  size_t best = 0;
+  for (size_t lane = 1; lane < LANES; lane++) {
+    if (laneKeys[lane] > laneKeys[best] || (laneKeys[lane] == laneKeys[best] && laneBands[lane] < laneBands[best]))
+      best = lane;
+  }
+  // Only bands whose keys are all -infinity are left.
+  band = Band(laneBands[best] < mNumBands ? laneBands[best] : firstAvailable);
+  return true;
+}
+
+template <class Metric, class Storage>
+const Band BandSorter<Metric, Storage>::getBestBand(const MacNodeId& id, const BandSet& reassigned) const {
+  Band band;
+  if (!tryGetBestBand(id, reassigned, band))
+    throw std::runtime_error("BandSorter::getBestBand called but no bands available.");
+  return band;
+}
+
+template <class Metric, class Storage>
+std::vector<Band> BandSorter<Metric, Storage>::getBestBands(const MacNodeId& id, const size_t k) const {
+  std::vector<Band> bands;
+  const NodeEntry* entry = findEntry(id);
+  if (entry == nullptr)
+    return bands;
+  rank(*entry);
+  for (size_t i = entry->next; i < entry->ranking.size() && bands.size() < k; i++) {
+    if (!mReassignedBands.test(entry->ranking[i]))
+      bands.push_back(entry->ranking[i]);
   }
-  if (bestRate == -1)
-    throw std::runtime_error("MaxDatarateSorter::getBestBand called but no bands available.");
-  return bestBand;
+  return bands;
 }
+
+template class BandSorter<RateMetric>;
+template class BandSorter<ProportionalFairMetric>;
+template class BandSorter<DeficitMetric>;
+template class BandSorter<RateMetric, CompactStorage>;
+template class BandSorter<ProportionalFairMetric, CompactStorage>;
+template class BandSorter<DeficitMetric, CompactStorage>;
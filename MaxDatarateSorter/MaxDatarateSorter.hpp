@@ -1,9 +1,22 @@
 #ifndef SCHEDULER_MAXDATARATESORTER_HPP
 #define SCHEDULER_MAXDATARATESORTER_HPP
 
+#include <algorithm>
+#include <cstddef>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iosfwd>
+#include <iterator>
+#include <limits>
 #include <map>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
+class WorkerPool;
+
 typedef unsigned short MacNodeId;
 typedef unsigned short Band;
 typedef unsigned int MacCid;
@@ -20,73 +33,930 @@ class IdRatePair {
     MacNodeId from, to;
     double rate, txPower;
     Direction dir;
-    bool reassigned = false;
     
-    bool operator>(const IdRatePair& other) {
+    bool operator>(const IdRatePair& other) const {
       return rate > other.rate;
     }
     
-    bool operator<(const IdRatePair& other) {
+    bool operator<(const IdRatePair& other) const {
       return !((*this) > other);
     }
 };
 
+/**
+ * How a CompactStorage stores an IdRatePair, in 16 bytes instead of 32. See PairCodec.
+ * There is no padding, so that the bytes of a list of these can be written and read as they are.
+ */
+class CompactIdRatePair {
+  public:
+    /**
+     * The rate, as a float's bits or as a fixed-point number.
+     */
+    uint32_t rate;
+    MacCid connectionId;
+    MacNodeId from, to;
+    /**
+     * The direction in bits 0-2 and the index of the tx power in bits 4-7. The other bits are 0.
+     */
+    uint32_t flags;
+};
+
+/**
+ * How writeBinary() writes an IdRatePair of the default storage, in 32 bytes without padding.
+ */
+class IdRatePairRecord {
+  public:
+    double rate, txPower;
+    MacCid connectionId;
+    MacNodeId from, to;
+    uint32_t dir;
+    /**
+     * Always 0.
+     */
+    uint32_t reserved;
+};
+
+/**
+ * Converts between IdRatePair and CompactIdRatePair. Rates are stored either as floats or,
+ * if a resolution is given, as 32 bit multiples of it. Tx powers take only a few configured values,
+ * which are kept in a table of up to MAX_TX_POWERS entries.
+ */
+class PairCodec {
+  public:
+    static const size_t MAX_TX_POWERS = 16;
+    
+    /**
+     * @param rateResolution 0 to store rates as floats, otherwise the step rates are rounded to.
+     */
+    explicit PairCodec(const double rateResolution = 0) : mRateResolution(rateResolution) {
+      if (rateResolution < 0)
+        throw std::invalid_argument("PairCodec called with a negative rate resolution.");
+    }
+    
+    /**
+     * @param rateResolution
+     * @param txPowers The table of tx powers to start with, e.g. those of the configuration.
+     */
+    PairCodec(const double rateResolution, const std::vector<double>& txPowers) : PairCodec(rateResolution) {
+      if (txPowers.size() > MAX_TX_POWERS)
+        throw std::length_error("PairCodec can't store more than " + std::to_string(MAX_TX_POWERS) + " different tx powers.");
+      mTxPowers = txPowers;
+    }
+    
+    /**
+     * @param pair
+     * @return 'pair' with its rate at the codec's precision.
+     * @throws std::invalid_argument If the rate can't be stored with a fixed-point resolution.
+     * @throws std::length_error If this would be the table's (MAX_TX_POWERS + 1)st tx power.
+     */
+    CompactIdRatePair encode(const IdRatePair& pair) {
+      CompactIdRatePair compact;
+      compact.rate = encodeRate(pair.rate);
+      compact.connectionId = pair.connectionId;
+      compact.from = pair.from;
+      compact.to = pair.to;
+      compact.flags = uint32_t(pair.dir & 7) | (uint32_t(txPowerIndex(pair.txPower)) << 4);
+      return compact;
+    }
+    
+    IdRatePair decode(const CompactIdRatePair& compact) const {
+      return IdRatePair(compact.connectionId, compact.from, compact.to, mTxPowers[(compact.flags >> 4) & 15], decodeRate(compact.rate), Direction(compact.flags & 7));
+    }
+    
+    uint32_t encodeRate(const double rate) const {
+      if (mRateResolution == 0) {
+        const float value = float(rate);
+        uint32_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return bits;
+      }
+      const double steps = std::round(rate / mRateResolution);
+      if (!(steps >= 0 && steps <= double(std::numeric_limits<uint32_t>::max())))
+        throw std::invalid_argument("PairCodec can't store rate " + std::to_string(rate) + " at resolution " + std::to_string(mRateResolution));
+      return uint32_t(steps);
+    }
+    
+    double decodeRate(const uint32_t bits) const {
+      if (mRateResolution == 0) {
+        float value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+      }
+      return bits * mRateResolution;
+    }
+    
+    /**
+     * @param rate
+     * @return 'rate' as it reads after being stored.
+     */
+    double round(const double rate) const {
+      return decodeRate(encodeRate(rate));
+    }
+    
+    double getRateResolution() const {
+      return mRateResolution;
+    }
+    
+    /**
+     * @return The tx powers seen so far, in the order of their indices.
+     */
+    const std::vector<double>& getTxPowers() const {
+      return mTxPowers;
+    }
+  
+  private:
+    uint8_t txPowerIndex(const double txPower) {
+      for (size_t i = 0; i < mTxPowers.size(); i++) {
+        if (mTxPowers[i] == txPower)
+          return uint8_t(i);
+      }
+      if (mTxPowers.size() == MAX_TX_POWERS)
+        throw std::length_error("PairCodec can't store more than " + std::to_string(MAX_TX_POWERS) + " different tx powers.");
+      mTxPowers.push_back(txPower);
+      return uint8_t(mTxPowers.size() - 1);
+    }
+    
+    double mRateResolution;
+    std::vector<double> mTxPowers;
+};
+
+/**
+ * A new rate for a node's pair on a band, see MaxDatarateSorter::updateRates.
+ */
+class RateUpdate {
+  public:
+    RateUpdate(const Band& band, const MacNodeId& from, const double rate) : band(band), from(from), rate(rate) {}
+    
+    Band band;
+    MacNodeId from;
+    double rate;
+};
+
+/**
+ * A set of bands with one bit per band.
+ */
+class BandSet {
+  public:
+    static const size_t BITS_PER_WORD = 64;
+    
+    explicit BandSet(size_t numBands) : mWords((numBands + BITS_PER_WORD - 1) / BITS_PER_WORD, 0) {}
+    
+    void set(const Band& band, const bool value) {
+      if (value)
+        mWords.at(band / BITS_PER_WORD) |= uint64_t(1) << (band % BITS_PER_WORD);
+      else
+        mWords.at(band / BITS_PER_WORD) &= ~(uint64_t(1) << (band % BITS_PER_WORD));
+    }
+    
+    bool test(const Band& band) const {
+      return (mWords.at(band / BITS_PER_WORD) >> (band % BITS_PER_WORD)) & 1;
+    }
+    
+    /**
+     * Removes all bands from the set.
+     */
+    void reset() {
+      for (size_t i = 0; i < mWords.size(); i++)
+        mWords[i] = 0;
+    }
+    
+    size_t numWords() const {
+      return mWords.size();
+    }
+    
+    /**
+     * @param i
+     * @return The bits of bands [i * BITS_PER_WORD, (i + 1) * BITS_PER_WORD).
+     */
+    uint64_t word(const size_t i) const {
+      return mWords[i];
+    }
+    
+    void setWord(const size_t i, const uint64_t bits) {
+      mWords.at(i) = bits;
+    }
+  
+  private:
+    std::vector<uint64_t> mWords;
+};
+
+/**
+ * What CompactStorage's iterators return from operator->, as they hand out decoded copies instead of references.
+ */
+class DecodedPair {
+  public:
+    explicit DecodedPair(const IdRatePair& pair) : mPair(pair) {}
+    
+    const IdRatePair* operator->() const {
+      return &mPair;
+    }
+  
+  private:
+    IdRatePair mPair;
+};
+
+/**
+ * Iterates over consecutive CompactIdRatePairs, decoding each as it is read.
+ */
+class CompactPairIterator {
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef IdRatePair value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef DecodedPair pointer;
+    typedef IdRatePair reference;
+    
+    CompactPairIterator(const CompactIdRatePair* current, const PairCodec* codec) : mCurrent(current), mCodec(codec) {}
+    
+    IdRatePair operator*() const {
+      return mCodec->decode(*mCurrent);
+    }
+    DecodedPair operator->() const {
+      return DecodedPair(**this);
+    }
+    CompactPairIterator& operator++() {
+      mCurrent++;
+      return *this;
+    }
+    CompactPairIterator operator++(int) {
+      CompactPairIterator previous = *this;
+      mCurrent++;
+      return previous;
+    }
+    bool operator==(const CompactPairIterator& other) const {
+      return mCurrent == other.mCurrent;
+    }
+    bool operator!=(const CompactPairIterator& other) const {
+      return mCurrent != other.mCurrent;
+    }
+  
+  private:
+    const CompactIdRatePair* mCurrent;
+    const PairCodec* mCodec;
+};
+
+/**
+ * How a BandSorter stores its pairs. This one, the default, keeps them as they are put,
+ * so that they are handed out by reference and read back exactly as they were put.
+ *
+ * A storage defines the type 'Stored' pairs are kept as, which has the fields 'from' and 'rate',
+ * the 'Record' writeBinary() writes per pair, and what reading hands out: a 'Reference' and 'Pointer' to a pair,
+ * an 'Iterator' over consecutive pairs and the 'List' of a band. See CompactStorage for the alternative.
+ */
+class IdRatePairStorage {
+  public:
+    typedef IdRatePair Stored;
+    typedef IdRatePairRecord Record;
+    typedef const IdRatePair& Reference;
+    typedef const IdRatePair* Pointer;
+    typedef const IdRatePair* Iterator;
+    typedef const std::vector<IdRatePair>& List;
+    
+    /**
+     * Identifies the storage in binary records.
+     */
+    static const uint8_t BINARY_ID = 0;
+    
+    const IdRatePair& encode(const IdRatePair& pair) const {
+      return pair;
+    }
+    const IdRatePair& decode(const IdRatePair& pair) const {
+      return pair;
+    }
+    const IdRatePair* pointer(const IdRatePair& pair) const {
+      return &pair;
+    }
+    const IdRatePair* iterator(const IdRatePair* pair) const {
+      return pair;
+    }
+    const std::vector<IdRatePair>& list(const std::vector<IdRatePair>& pairs) const {
+      return pairs;
+    }
+    Direction dir(const IdRatePair& pair) const {
+      return pair.dir;
+    }
+    
+    /**
+     * @param pair
+     * @param rate
+     * @throws std::invalid_argument If 'rate' can't be stored, which doesn't happen here.
+     */
+    void setRate(IdRatePair& pair, const double rate) const {
+      pair.rate = rate;
+    }
+    void checkRate(const double) const {}
+};
+
+/**
+ * A read-only view on consecutive pairs of a band. Nothing is copied; with a CompactStorage the pairs
+ * are decoded as they are read. A view is invalidated by any change to the container it was taken from.
+ */
+template <class Storage>
+class BasicPairRange {
+  public:
+    typedef typename Storage::Iterator const_iterator;
+    
+    BasicPairRange(const typename Storage::Stored* first, const typename Storage::Stored* last, const Storage* storage)
+        : mFirst(first), mLast(last), mStorage(storage) {}
+    
+    const_iterator begin() const {
+      return mStorage->iterator(mFirst);
+    }
+    const_iterator end() const {
+      return mStorage->iterator(mLast);
+    }
+    bool empty() const {
+      return mFirst == mLast;
+    }
+    size_t size() const {
+      return size_t(mLast - mFirst);
+    }
+    typename Storage::Reference operator[](const size_t position) const {
+      return mStorage->decode(mFirst[position]);
+    }
+    /**
+     * @param position
+     * @return The pair at 'position'.
+     * @throws std::out_of_range If there are no more than 'position' pairs.
+     */
+    typename Storage::Reference at(const size_t position) const {
+      if (position >= size())
+        throw std::out_of_range("PairRange::at called for position " + std::to_string(position) + " of " + std::to_string(size()));
+      return (*this)[position];
+    }
+    
+    /**
+     * Copies the pairs shown, for callers that need a container of their own.
+     */
+    operator std::vector<IdRatePair>() const {
+      return std::vector<IdRatePair>(begin(), end());
+    }
+  
+  private:
+    const typename Storage::Stored* mFirst;
+    const typename Storage::Stored* mLast;
+    const Storage* mStorage;
+};
+
+/**
+ * Stores pairs as CompactIdRatePair, in 16 bytes instead of 32, so that four of them fit into a cache line.
+ * Rates are kept at the precision of the PairCodec, so pairs are handed out decoded, by value.
+ */
+class CompactStorage {
+  public:
+    typedef CompactIdRatePair Stored;
+    typedef CompactIdRatePair Record;
+    typedef IdRatePair Reference;
+    typedef DecodedPair Pointer;
+    typedef CompactPairIterator Iterator;
+    typedef BasicPairRange<CompactStorage> List;
+    
+    static const uint8_t BINARY_ID = 1;
+    
+    explicit CompactStorage(const PairCodec& codec = PairCodec()) : mCodec(codec) {}
+    
+    /**
+     * @throws std::length_error If 'pair' has a tx power beyond the codec's table.
+     */
+    CompactIdRatePair encode(const IdRatePair& pair) {
+      return mCodec.encode(pair);
+    }
+    IdRatePair decode(const CompactIdRatePair& pair) const {
+      return mCodec.decode(pair);
+    }
+    DecodedPair pointer(const CompactIdRatePair& pair) const {
+      return DecodedPair(decode(pair));
+    }
+    CompactPairIterator iterator(const CompactIdRatePair* pair) const {
+      return CompactPairIterator(pair, &mCodec);
+    }
+    BasicPairRange<CompactStorage> list(const std::vector<CompactIdRatePair>& pairs) const {
+      return BasicPairRange<CompactStorage>(pairs.data(), pairs.data() + pairs.size(), this);
+    }
+    Direction dir(const CompactIdRatePair& pair) const {
+      return Direction(pair.flags & 7);
+    }
+    
+    /**
+     * @throws std::invalid_argument If the codec can't store 'rate'.
+     */
+    void setRate(CompactIdRatePair& pair, const double rate) const {
+      pair.rate = mCodec.encodeRate(rate);
+    }
+    void checkRate(const double rate) const {
+      mCodec.encodeRate(rate);
+    }
+    
+    const PairCodec& getCodec() const {
+      return mCodec;
+    }
+  
+  private:
+    PairCodec mCodec;
+};
+
+/**
+ * A read-only view on a band's <id, throughput> pairs that only shows the pairs of one direction,
+ * or all but the pairs of one direction. The pairs keep their order and nothing is copied.
+ * A view is invalidated by any change to the container it was taken from.
+ */
+template <class Storage>
+class BasicDirectionView {
+  public:
+    class const_iterator {
+      public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef IdRatePair value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef typename Storage::Pointer pointer;
+        typedef typename Storage::Reference reference;
+        
+        const_iterator(const typename Storage::Stored* pairs, const Storage* storage, size_t current, size_t end, const Direction dir, const bool exclude)
+            : mPairs(pairs), mStorage(storage), mCurrent(current), mEnd(end), mDir(dir), mExclude(exclude) {
+          skip();
+        }
+        
+        reference operator*() const {
+          return mStorage->decode(mPairs[mCurrent]);
+        }
+        pointer operator->() const {
+          return mStorage->pointer(mPairs[mCurrent]);
+        }
+        const_iterator& operator++() {
+          mCurrent++;
+          skip();
+          return *this;
+        }
+        const_iterator operator++(int) {
+          const_iterator previous = *this;
+          ++(*this);
+          return previous;
+        }
+        bool operator==(const const_iterator& other) const {
+          return mCurrent == other.mCurrent;
+        }
+        bool operator!=(const const_iterator& other) const {
+          return mCurrent != other.mCurrent;
+        }
+      
+      private:
+        /**
+         * Advances to the next pair that is shown. Pairs that are skipped aren't decoded.
+         */
+        void skip() {
+          while (mCurrent != mEnd && (mStorage->dir(mPairs[mCurrent]) == mDir) == mExclude)
+            mCurrent++;
+        }
+        
+        const typename Storage::Stored* mPairs;
+        const Storage* mStorage;
+        size_t mCurrent, mEnd;
+        Direction mDir;
+        bool mExclude;
+    };
+    
+    /**
+     * @param pairs The band's pairs.
+     * @param storage Hands out 'pairs'.
+     * @param size
+     * @param dir
+     * @param exclude If true, all pairs except those in 'dir' direction are shown.
+     */
+    BasicDirectionView(const typename Storage::Stored* pairs, const Storage* storage, const size_t size, const Direction dir, const bool exclude)
+        : mPairs(pairs), mStorage(storage), mSize(size), mDir(dir), mExclude(exclude) {}
+    
+    const_iterator begin() const {
+      return const_iterator(mPairs, mStorage, 0, mSize, mDir, mExclude);
+    }
+    const_iterator end() const {
+      return const_iterator(mPairs, mStorage, mSize, mSize, mDir, mExclude);
+    }
+    
+    bool empty() const {
+      return begin() == end();
+    }
+    
+    /**
+     * @return The number of pairs shown. Counting them takes a pass over the band's pairs.
+     */
+    size_t size() const {
+      return size_t(std::distance(begin(), end()));
+    }
+    
+    /**
+     * Copies the pairs shown, for callers that need a container of their own.
+     */
+    operator std::vector<IdRatePair>() const {
+      return std::vector<IdRatePair>(begin(), end());
+    }
+  
+  private:
+    const typename Storage::Stored* mPairs;
+    const Storage* mStorage;
+    size_t mSize;
+    Direction mDir;
+    bool mExclude;
+};
+
+typedef BasicPairRange<IdRatePairStorage> PairRange;
+typedef BasicDirectionView<IdRatePairStorage> DirectionView;
+
+/**
+ * Ranks by datarate, for the MAX_DATARATE discipline.
+ */
+class RateMetric {
+  public:
+    double key(const IdRatePair& pair) const {
+      return pair.rate;
+    }
+};
+
+/**
+ * Ranks by datarate relative to the node's average throughput, for the PF discipline.
+ */
+class ProportionalFairMetric {
+  public:
+    double key(const IdRatePair& pair) const {
+      std::unordered_map<MacNodeId, double>::const_iterator it = mAverageThroughput.find(pair.from);
+      // Nodes without an average yet count as if it was 1.
+      return it == mAverageThroughput.end() ? pair.rate : pair.rate / it->second;
+    }
+    
+    /**
+     * @param id
+     * @param averageThroughput Must be positive.
+     */
+    void setAverageThroughput(const MacNodeId& id, const double averageThroughput) {
+      mAverageThroughput[id] = averageThroughput;
+    }
+  
+  private:
+    std::unordered_map<MacNodeId, double> mAverageThroughput;
+};
+
+/**
+ * Ranks by the node's deficit counter, for the DRR discipline.
+ */
+class DeficitMetric {
+  public:
+    double key(const IdRatePair& pair) const {
+      std::unordered_map<MacNodeId, double>::const_iterator it = mDeficit.find(pair.from);
+      return it == mDeficit.end() ? 0 : it->second;
+    }
+    
+    void setDeficit(const MacNodeId& id, const double deficit) {
+      mDeficit[id] = deficit;
+    }
+  
+  private:
+    std::unordered_map<MacNodeId, double> mDeficit;
+};
+
 /**
  * This container can be given <node id, throughput> pairs.
- * It always keeps the internal list sorted according to throughput.
+ * It keeps one list per band sorted according to the key 'Metric' assigns to each pair.
+ * 'Metric' provides 'double key(const IdRatePair&) const', higher is better. It is called once per pair when it is put,
+ * sorting compares the cached keys. Its state is only changed through setMetric(), which re-sorts the container.
+ *
+ * 'Storage' decides how pairs are kept, see IdRatePairStorage. By default they are kept as they are put
+ * and handed out by reference. With CompactStorage they take half the memory, but are handed out decoded,
+ * with their rates at the precision of its PairCodec; keys are computed from the decoded pairs then.
+ *
+ * When the container is refilled from scratch, call clear(), put() all pairs and then finalize().
+ * That sorts each band exactly once. Constructed with a maximum number of pairs per band, all memory
+ * is allocated up front and doing so makes no heap allocations, except for finalize() with a number of threads.
+ *
+ * Without finalize(), reading is lazy: the const members that read a band first sort the pairs put to it since
+ * it was last read, and getBestBand() and its siblings rank the node's bands. Both write to mutable members,
+ * so const members may only be called from several threads at once after finalize() and until the next
+ * non-const call, such as markBand(). DoubleBufferedSorter publishes its snapshots in that state.
+ *
+ * The member definitions are in MaxDatarateSorter.cpp, which instantiates this for the metrics and storages above.
  */
-class MaxDatarateSorter {
+template <class Metric, class Storage = IdRatePairStorage>
+class BandSorter {
   public:
-    MaxDatarateSorter(size_t numBands);
+    typedef BasicPairRange<Storage> PairRange;
+    typedef BasicDirectionView<Storage> DirectionView;
+    
+    /**
+     * Visits the pairs of all bands in descending order of their keys, among equal keys those of lower
+     * bands first. The bands' lists are merged lazily through a heap of their heads, so visiting the
+     * first k pairs costs O(numBands + k log numBands). An iterator is invalidated by any change to the container.
+     */
+    class GlobalIterator {
+      public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef IdRatePair value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef typename Storage::Pointer pointer;
+        typedef typename Storage::Reference reference;
+        
+        /**
+         * The end iterator.
+         */
+        GlobalIterator() : mSorter(nullptr) {}
+        
+        /**
+         * Starts at the best pair. All of 'sorter's bands must be flushed.
+         * @param sorter
+         */
+        explicit GlobalIterator(const BandSorter& sorter) : mSorter(&sorter) {
+          mHeads.reserve(sorter.mNumBands);
+          for (Band band(0); band < sorter.mNumBands; band++) {
+            if (!sorter.mBandToIdRate[band].empty())
+              mHeads.push_back(Head(sorter.mRanks[band][0].key, band, 0));
+          }
+          std::make_heap(mHeads.begin(), mHeads.end(), HeadLess());
+        }
+        
+        /**
+         * @return The band of the current pair.
+         */
+        Band band() const {
+          return mHeads.front().band;
+        }
+        /**
+         * @return The current pair's position within its band.
+         */
+        size_t position() const {
+          return mHeads.front().position;
+        }
+        
+        reference operator*() const {
+          return mSorter->mStorage.decode(mSorter->mBandToIdRate[band()][position()]);
+        }
+        pointer operator->() const {
+          return mSorter->mStorage.pointer(mSorter->mBandToIdRate[band()][position()]);
+        }
+        GlobalIterator& operator++() {
+          std::pop_heap(mHeads.begin(), mHeads.end(), HeadLess());
+          Head& head = mHeads.back();
+          head.position++;
+          const std::vector<RankKey>& ranks = mSorter->mRanks[head.band];
+          if (head.position < ranks.size()) {
+            head.key = ranks[head.position].key;
+            std::push_heap(mHeads.begin(), mHeads.end(), HeadLess());
+          } else {
+            mHeads.pop_back();
+          }
+          return *this;
+        }
+        GlobalIterator operator++(int) {
+          GlobalIterator previous = *this;
+          ++(*this);
+          return previous;
+        }
+        bool operator==(const GlobalIterator& other) const {
+          if (mHeads.empty() || other.mHeads.empty())
+            return mHeads.empty() == other.mHeads.empty();
+          return band() == other.band() && position() == other.position();
+        }
+        bool operator!=(const GlobalIterator& other) const {
+          return !(*this == other);
+        }
+        
+      private:
+        /**
+         * The next pair of a band that wasn't visited yet.
+         */
+        class Head {
+          public:
+            Head(const double key, const Band band, const size_t position) : key(key), band(band), position(position) {}
+            double key;
+            Band band;
+            size_t position;
+        };
+        
+        /**
+         * Orders the heap so that the best key, and among equal keys the lowest band, is on top.
+         */
+        class HeadLess {
+          public:
+            bool operator()(const Head& a, const Head& b) const {
+              return a.key < b.key || (a.key == b.key && a.band > b.band);
+            }
+        };
+        
+        const BandSorter* mSorter;
+        std::vector<Head> mHeads;
+    };
+    
+    BandSorter(size_t numBands, const Metric& metric = Metric());
+    
+    /**
+     * Allocates all memory for up to 'maxPairsPerBand' pairs per band up front.
+     * Per node, memory is allocated when it is first put and kept from then on.
+     * @param numBands
+     * @param maxPairsPerBand 0 for no limit.
+     * @param metric
+     */
+    BandSorter(size_t numBands, size_t maxPairsPerBand, const Metric& metric = Metric());
     
+    /**
+     * @param numBands
+     * @param maxPairsPerBand 0 for no limit.
+     * @param storage E.g. a CompactStorage with the precision rates are stored at.
+     * @param metric
+     */
+    BandSorter(size_t numBands, size_t maxPairsPerBand, const Storage& storage, const Metric& metric = Metric());
+    
+    /**
+     * Puts 'idRatePair' into 'band's list in O(1).
+     * The list is brought back into order the next time 'band' is read. A pair is ranked in front of
+     * all pairs with an equal key that were put before it.
+     * @param band
+     * @param idRatePair
+     * @throws std::length_error If 'band' already holds the maximum number of pairs given on construction,
+     *                           or the storage can't store 'idRatePair'.
+     */
     void put(const Band& band, const IdRatePair& idRatePair);
     
+    /**
+     * Sorts all bands that were put to since they were last read and ranks every node's bands.
+     * Reading does this implicitly, but calling this once after a bulk of put() calls
+     * lets the work be split over several threads. Afterwards const members don't change the container
+     * until a non-const member is called, so that several threads can read it at once. See the class comment.
+     * @param numThreads Number of threads to sort the bands on, 1 sorts on the calling thread.
+     *                   More than 1 starts a WorkerPool for this call.
+     */
+    void finalize(const size_t numThreads = 1);
+    
+    /**
+     * Like finalize(numThreads), but sorts the bands on 'pool's threads, each taking the next unsorted band
+     * when it is done with one. The result is the same as when sorting serially, independently of
+     * which thread sorted which band.
+     * @param pool
+     */
+    void finalize(WorkerPool& pool);
+    
+    /**
+     * Removes all pairs from all bands and unmarks all bands. Allocated memory, including that of
+     * the per-node index, is kept for reuse.
+     */
+    void clear();
+    
     /**
      * Removes 'id' from all elements in this container where element.from == 'id'.
+     * Only the bands that hold a pair of 'id' are touched.
      * @param id
      */
     void remove(const MacNodeId id);
     
+    /**
+     * Sets the rate of 'from's pair on 'band' and moves the pair to its new rank, in front of pairs with an equal key.
+     * Only the pairs between its old and its new rank are moved. If 'from' has several pairs on 'band', its best one is updated,
+     * and finding its best one afterwards takes a pass over the band.
+     * @param band
+     * @param from
+     * @param rate
+     * @throws std::invalid_argument If 'from' has no pair on 'band' or the storage can't store 'rate'.
+     */
+    void updateRate(const Band& band, const MacNodeId& from, const double rate);
+    
+    /**
+     * Applies 'updates' in order, as if updateRate() was called for each.
+     * @param updates
+     * @throws std::invalid_argument If any update refers to a missing pair. Then no update is applied.
+     */
+    void updateRates(const std::vector<RateUpdate>& updates);
+    
     /**
      * Marks 'band' as 'reassigned'. Reassigned bands are not considered when looking for a best band.
+     * This is O(1), the band's pairs are not touched. Pairs put into a marked band are reassigned as well.
      * @param band
+     * @throws std::out_of_range If the container has no such band.
      */
     void markBand(const Band &band, const bool reassigned);
     
     /**
-     *
+     * @param band
+     * @return Whether 'band' is marked as reassigned.
+     * @throws std::out_of_range If the container has no such band.
+     */
+    bool isReassigned(const Band& band) const;
+    
+    /**
+     * Sorts 'band' first if pairs were put to it since it was last read.
      * @param band
      * @param position
-     * @return The xth best node according to throughput.
+     * @return The xth best node according to the metric, i.e. throughput for MaxDatarateSorter.
      */
-    const IdRatePair& get(const Band& band, const size_t& position) const;
+    typename Storage::Reference get(const Band& band, const size_t& position) const;
     
     /**
+     * The reverse of get(). Binary searches 'band's key column for the rank of the node's best pair,
+     * which no other pair shares, so this costs O(log n) even when many pairs have the same key.
+     * Sorts 'band' first if pairs were put to it since it was last read.
      * @param band
-     * @return All <id, throughput> pairs for 'band'.
+     * @param id
+     * @return The position of 'id's best pair on 'band'.
+     * @throws std::invalid_argument If 'id' has no pair on 'band'.
      */
-    const std::vector<IdRatePair>& at(const Band &band) const;
+    size_t rankOf(const Band& band, const MacNodeId& id) const;
+    
+    /**
+     * This and the other views below sort 'band' first if pairs were put to it since it was last read.
+     * @param band
+     * @return All <id, throughput> pairs for 'band': the list itself by default, a decoding view with CompactStorage.
+     */
+    typename Storage::List at(const Band &band) const;
     
     /**
      * @param band
      * @param dir
-     * @return All <id, throughput> pairs for 'band' where 'id' wants to transmit in 'dir' direction.
+     * @return A view on all <id, throughput> pairs for 'band' where 'id' wants to transmit in 'dir' direction.
+     */
+    DirectionView at(const Band& band, const Direction& dir) const;
+    
+    /**
+     * @param band
+     * @return A view on all <id, throughput> pairs for 'band' where 'id' wants to transmit in any non-D2D direction.
      */
-    const std::vector<IdRatePair> at(const Band& band, const Direction& dir) const;
+    DirectionView at_nonD2D(const Band& band) const;
     
     /**
+     * As the list is sorted, its boundary is found by binary search on the key column.
      * @param band
-     * @return All <id, throughput> pairs for 'band' where 'id' wants to transmit in any non-D2D direction.
+     * @param minKey
+     * @return A view on the pairs for 'band' whose key, i.e. throughput for MaxDatarateSorter, is at least 'minKey'.
+     */
+    PairRange range(const Band& band, const double minKey) const;
+    
+    /**
+     * @param band
+     * @param minKey
+     * @param dir
+     * @return A view on the pairs for 'band' whose key is at least 'minKey' and where 'id' wants to transmit in 'dir' direction.
+     */
+    DirectionView range(const Band& band, const double minKey, const Direction& dir) const;
+    
+    /**
+     * Sorts all bands that were put to since they were last read.
+     * @return An iterator over the pairs of all bands, best key first. See GlobalIterator.
      */
-    const std::vector<IdRatePair> at_nonD2D(const Band& band) const;
+    GlobalIterator globalBegin() const;
+    GlobalIterator globalEnd() const {
+      return GlobalIterator();
+    }
     
     /**
+     * Sorts all bands that were put to since they were last read, like globalBegin().
+     * @param k
+     * @return The 'k' best <band, pair> entries over all bands, best key first. Fewer if the container holds fewer pairs.
+     */
+    std::vector<std::pair<Band, IdRatePair>> topK(const size_t k) const;
+    
+    /**
+     * The node's bands are ranked once after its pairs change. From then on each call continues
+     * where the last one stopped, skipping bands marked as reassigned in between, so that
+     * alternating getBestBand() and markBand() costs O(1) per call on average.
+     * The bands' lists are not scanned.
      * @param id
-     * @return The best band datarate-wise for 'id'. Bands marked as 'reassigned' are not considered.
+     * @return The best band metric-wise for 'id'. Bands marked as 'reassigned' are not considered.
      * @throws If no best band can be found.
      */
     const Band getBestBand(const MacNodeId& id) const;
     
+    /**
+     * Like getBestBand(), but signals that no band is left through its return value instead of throwing.
+     * @param id
+     * @param band Set to the best band if there is one.
+     * @return Whether there is a band left for 'id'.
+     */
+    bool tryGetBestBand(const MacNodeId& id, Band& band) const;
+    
+    /**
+     * For readers that share the container, e.g. through a DoubleBufferedSorter snapshot: each keeps its own set
+     * of reassigned bands instead of calling markBand(). Nothing is written, so any number of threads can call this
+     * at once, as long as no non-const member and none of the overloads without 'reassigned' are called meanwhile.
+     * After finalize() this reads the node's ranking and costs O(1) per band skipped. Before, it takes a branch-free
+     * pass over the node's row of best keys instead of ranking them.
+     * @param id
+     * @param reassigned Bands not to consider, in addition to those marked in the container.
+     * @param band Set to the best band if there is one.
+     * @return Whether there is a band left for 'id'.
+     * @throws std::invalid_argument If 'reassigned' holds fewer bands than the container.
+     */
+    bool tryGetBestBand(const MacNodeId& id, const BandSet& reassigned, Band& band) const;
+    
+    /**
+     * Like tryGetBestBand(id, reassigned, band), but throws if no band is left.
+     * @param id
+     * @param reassigned
+     * @return The best band metric-wise for 'id' that is neither in 'reassigned' nor marked as reassigned.
+     * @throws If no best band can be found.
+     */
+    const Band getBestBand(const MacNodeId& id, const BandSet& reassigned) const;
+    
+    /**
+     * Reads the node's ranking once instead of calling getBestBand() and markBand() in turns.
+     * @param id
+     * @param k
+     * @return Up to 'k' bands for 'id' that are not marked as 'reassigned', best first. Empty if there are none.
+     */
+    std::vector<Band> getBestBands(const MacNodeId& id, const size_t k) const;
+    
     /**
      * @return The number of bands.
      */
@@ -94,17 +964,384 @@ class MaxDatarateSorter {
       return mBandToIdRate.size();
     }
     
+    /**
+     * @return The metric pairs are ranked by.
+     */
+    const Metric& getMetric() const {
+      return mMetric;
+    }
+    
+    /**
+     * Replaces the metric, e.g. with one that holds this TTI's average throughputs. All keys are computed anew,
+     * the bands are re-sorted and all nodes' bands re-ranked, so this costs about as much as putting all pairs again.
+     * Among pairs whose new keys are equal the current order is kept. Views and iterators are invalidated.
+     * @param metric
+     */
+    void setMetric(const Metric& metric);
+    
+    const Storage& getStorage() const {
+      return mStorage;
+    }
+    
     std::string toString() const;
     std::string toString(std::string prefix) const;
     
+    /**
+     * Writes what toString(prefix) returns, minus its leading line break, straight into 'out'.
+     * Each line is formatted into a buffer on the stack, so that nothing is allocated per pair.
+     * Like toString(), sorts the bands that were put to since they were last read.
+     * @param out
+     * @param prefix Put in front of each line.
+     */
+    void write(std::ostream& out, const std::string& prefix = std::string()) const;
+    
+    /**
+     * Writes the bands' lists in their sorted order, the marked bands and the storage's state in binary, in host byte order:
+     * the magic "MDRS", uint16 format version, uint16 number of bands, uint8 Storage::BINARY_ID, the storage's state,
+     * per band a uint32 number of pairs followed by the pairs as Storage::Records, and finally the marked bands as
+     * uint64 words of bits. Only CompactStorage has a state: double rate resolution, uint8 number of tx powers and
+     * the tx powers as doubles. Its 16 byte CompactIdRatePairs are written as stored, with one write per band.
+     * IdRatePairs are converted to 32 byte IdRatePairRecords through a buffer on the stack.
+     * Sorts the bands that were put to since they were last read first.
+     * @param out
+     */
+    void writeBinary(std::ostream& out) const;
+    
+    /**
+     * For logging every TTI: writes only what changed since the last call, or all like writeBinary() on the first call.
+     * A delta starts with the magic "MDRD" and the same header and storage state as writeBinary(). Then follows a uint16
+     * number of changed bands and for each the uint16 band, the uint32 numbers of pairs kept from the front and the back
+     * of the band's previous list, and a uint32 number of pairs followed by the pairs that replace the ones in between.
+     * It ends with the marked bands. Keeps a copy of the lists to compare the next call against.
+     * @param out
+     */
+    void writeBinaryDelta(std::ostream& out);
+    
+    /**
+     * Reads one record written by writeBinary() or writeBinaryDelta(). A full record replaces the contents of this container,
+     * including its storage state, and reads each band's pairs in with one read, or in blocks for IdRatePairStorage. A delta is applied to the current contents,
+     * which must be what the delta's writer had written before. The bands are sorted afterwards, as they were written.
+     * @param in
+     * @throws std::runtime_error If 'in' doesn't hold a valid record for this number of bands and storage. The container is cleared then.
+     * @throws std::length_error If a band would hold more than the maximum number of pairs given on construction.
+     *                           The container is cleared then as well.
+     */
+    void readBinary(std::istream& in);
+    
+    static const uint16_t BINARY_FORMAT_VERSION = 2;
+    
   private:
+    /**
+     * Where a node's pairs are, so that per-node operations don't have to scan all bands.
+     */
+    class NodeEntry {
+      public:
+        NodeEntry(size_t numBands, size_t slot) : bands(numBands), slot(slot), rankingValid(false), next(0), unmarkCount(0), generation(0) {
+          ranking.reserve(numBands);
+        }
+        
+        /**
+         * The bands this node has pairs in.
+         */
+        BandSet bands;
+        /**
+         * The node's row in the container's per-node matrices.
+         */
+        size_t slot;
+        
+        /**
+         * The bands in 'bands', best key first. Built by getBestBand() when needed.
+         */
+        mutable std::vector<Band> ranking;
+        /**
+         * Whether 'ranking' matches the node's best keys.
+         */
+        mutable bool rankingValid;
+        /**
+         * Position in 'ranking' before which all bands are known to be reassigned.
+         */
+        mutable size_t next;
+        /**
+         * The container's number of unmarked bands when 'next' was last valid.
+         * Unmarking a band may make an earlier band in 'ranking' available again.
+         */
+        mutable unsigned long unmarkCount;
+        /**
+         * The container's generation this entry belongs to. Entries of earlier generations are empty.
+         */
+        unsigned long generation;
+    };
+    
+    typedef std::unordered_map<MacNodeId, NodeEntry> NodeIndex;
+    
+    /**
+     * Where a pair ranks within its band: by descending key, and among equal keys the pair put last first.
+     * No two pairs of a band have the same rank, so a pair's position can be binary searched for.
+     */
+    class RankKey {
+      public:
+        RankKey(const double key, const uint64_t sequence) : key(key), sequence(sequence) {}
+        
+        bool operator>(const RankKey& other) const {
+          return key > other.key || (key == other.key && sequence > other.sequence);
+        }
+        
+        double key;
+        /**
+         * When the pair was put or its rate last updated, see mSequence.
+         */
+        uint64_t sequence;
+    };
+    
+    /**
+     * A pair's rank and position in its band's list. flush() sorts these instead of the pairs themselves.
+     */
+    class RankedPosition {
+      public:
+        RankedPosition(const RankKey& rank, const size_t position) : rank(rank), position(position) {}
+        RankKey rank;
+        size_t position;
+    };
+    
+    class RankGreater {
+      public:
+        bool operator()(const RankedPosition& a, const RankedPosition& b) const {
+          return a.rank > b.rank;
+        }
+    };
+    
+    /**
+     * Scratch space for flush(). Allocated up front for the maximum number of pairs per band, if there is one.
+     */
+    class SortBuffer {
+      public:
+        explicit SortBuffer(const size_t capacity) {
+          pairs.reserve(capacity);
+          order.reserve(capacity);
+        }
+        
+        std::vector<typename Storage::Stored> pairs;
+        std::vector<RankedPosition> order;
+    };
+    
+    double keyOf(const typename Storage::Stored& pair) const {
+      return mMetric.key(mStorage.decode(pair));
+    }
+    
+    /**
+     * @param id
+     * @return 'id's entry, nullptr if it has none in the current generation.
+     */
+    const NodeEntry* findEntry(const MacNodeId& id) const;
+    NodeEntry* findEntry(const MacNodeId& id);
+    
+    /**
+     * @param id
+     * @return 'id's entry, created or emptied first if it has none in the current generation.
+     */
+    NodeEntry& getEntry(const MacNodeId& id);
+    
+    /**
+     * @param entry
+     * @return The node's row of best keys: per band the key of its best pair, -infinity if it has none there.
+     */
+    double* bestKeys(const NodeEntry& entry) {
+      return &mBestKeys[entry.slot * mNumBands];
+    }
+    const double* bestKeys(const NodeEntry& entry) const {
+      return &mBestKeys[entry.slot * mNumBands];
+    }
+    
+    /**
+     * @param entry
+     * @return The node's row of the sequence numbers that go with its best keys.
+     */
+    uint64_t* bestSequences(const NodeEntry& entry) {
+      return &mBestSequences[entry.slot * mNumBands];
+    }
+    
+    /**
+     * @param entry
+     * @param band
+     * @return The rank of the node's best pair on 'band'.
+     */
+    RankKey bestRank(const NodeEntry& entry, const Band& band) const {
+      return RankKey(mBestKeys[entry.slot * mNumBands + band], mBestSequences[entry.slot * mNumBands + band]);
+    }
+    
+    void setBestRank(const NodeEntry& entry, const Band& band, const RankKey& rank) {
+      bestKeys(entry)[band] = rank.key;
+      bestSequences(entry)[band] = rank.sequence;
+    }
+    
+    /**
+     * @param entry
+     * @return The node's row of pair counts per band.
+     */
+    unsigned int* numPairs(const NodeEntry& entry) {
+      return &mNumPairs[entry.slot * mNumBands];
+    }
+    const unsigned int* numPairs(const NodeEntry& entry) const {
+      return &mNumPairs[entry.slot * mNumBands];
+    }
+    
+    /**
+     * Brings 'entry's ranking up-to-date and advances its cursor to the first band that isn't marked.
+     * @param entry
+     */
+    void rank(const NodeEntry& entry) const;
+    
+    /**
+     * Calls rank() for every node in the container.
+     */
+    void rankAll() const;
+    
+    /**
+     * Searches the node's row of best keys for the best band that is neither marked nor in 'reassigned',
+     * without ranking the node's bands. The row is read in LANES independent lanes.
+     * @param entry
+     * @param reassigned
+     * @param band Set to the best band if there is one.
+     * @return Whether there is a band left.
+     */
+    bool findBestBand(const NodeEntry& entry, const BandSet& reassigned, Band& band) const;
+    
+    static const size_t LANES = 4;
+    
+    /**
+     * Computes the ranks of all of 'band's pairs anew. Among equal keys, pairs keep the order of the list.
+     * @param band
+     */
+    void computeRanks(const Band& band);
+    
+    /**
+     * Rebuilds the node index from the bands' lists and ranks, which must be sorted.
+     */
+    void rebuildIndex();
+    
+    /**
+     * Reads the rest of a record for readBinary(), after the magic.
+     * @param in
+     * @param isDelta Whether the record is a delta.
+     */
+    void readRecord(std::istream& in, const bool isDelta);
+    
+    /**
+     * Writes the header after the magic, and the storage state.
+     * @param out
+     */
+    void writeHeader(std::ostream& out) const;
+    
+    /**
+     * Reads the header after the magic, and the storage state.
+     * @param in
+     * @param isDelta If true, the storage state read must extend the current one.
+     */
+    void readHeader(std::istream& in, const bool isDelta);
+    
+    /**
+     * Sorts the pairs put since 'band' was last read and merges them into its sorted list.
+     * @param band
+     */
+    void flush(const Band& band) const;
+    
+    /**
+     * @param band
+     * @param buffer Scratch space, so that concurrent flushes of different bands don't share any.
+     */
+    void flush(const Band& band, SortBuffer& buffer) const;
+    
+    /**
+     * @param band
+     * @param minKey
+     * @return The number of pairs on 'band', which must be flushed, whose key is at least 'minKey'.
+     */
+    size_t countAtLeast(const Band& band, const double minKey) const;
+    
+    /**
+     * @param band
+     * @param from
+     * @return The position of 'from's best pair in 'band's sorted list.
+     */
+    size_t findPair(const Band& band, const MacNodeId& from) const;
+    
+    /**
+     * @param from
+     * @param band
+     * @return Whether 'from' has a pair on 'band'.
+     */
+    bool hasPair(const MacNodeId& from, const Band& band) const;
+    
+    Metric mMetric;
+    Storage mStorage;
     /**
      * The outer vector corresponds to the bands.
-     * Each inner vector holds an always-sorted list of <id, rate> pairs in descending order rate-wise.
+     * Each inner vector holds a sorted list of <id, rate> pairs in descending order key-wise,
+     * followed by the pairs that were put since the band was last read.
     **/
-    std::vector<std::vector<IdRatePair>> mBandToIdRate;
+    mutable std::vector<std::vector<typename Storage::Stored>> mBandToIdRate;
+    /**
+     * Per band, the length of the sorted front part of its list.
+     */
+    mutable std::vector<size_t> mNumSorted;
+    /**
+     * Scratch space for sorting. Kept as a member so that its capacity is reused.
+     */
+    mutable SortBuffer mSortBuffer;
+    /**
+     * One sort buffer per thread of the pool finalize() was last given.
+     */
+    std::vector<SortBuffer> mWorkerBuffers;
+    /**
+     * Per band the rank of each pair in its list, with the key computed once when the pair is put. Sorting and searching
+     * compare these instead of decoding pairs and asking the metric again.
+     */
+    mutable std::vector<std::vector<RankKey>> mRanks;
+    /**
+     * The next sequence number for RankKey. Counts the pairs put and rates updated.
+     */
+    uint64_t mSequence;
+    /**
+     * Maps a node id to where its pairs are. Kept up-to-date by put() and remove().
+     * clear() doesn't remove entries, it starts a new generation instead.
+     */
+    NodeIndex mNodeIndex;
+    /**
+     * Node-by-band matrices, one row per node slot, so that a per-node query reads a single row.
+     * A node keeps its slot once it has one.
+     */
+    std::vector<double> mBestKeys;
+    std::vector<uint64_t> mBestSequences;
+    std::vector<unsigned int> mNumPairs;
+    unsigned long mGeneration;
+    /**
+     * The bands marked as reassigned.
+     */
+    BandSet mReassignedBands;
+    /**
+     * How often a band has been unmarked, see NodeEntry::unmarkCount.
+     */
+    unsigned long mUnmarkCount;
     const size_t mNumBands;
+    /**
+     * The maximum number of pairs per band, 0 for no limit.
+     */
+    const size_t mMaxPairsPerBand;
+    /**
+     * What writeBinaryDelta() last wrote, to compare against. Empty before its first call.
+     */
+    std::vector<std::vector<typename Storage::Stored>> mLastWritten;
 };
 
+/**
+ * Ranks <node id, throughput> pairs by throughput.
+ */
+typedef BandSorter<RateMetric> MaxDatarateSorter;
+
+/**
+ * Like MaxDatarateSorter, with pairs stored as CompactIdRatePair.
+ */
+typedef BandSorter<RateMetric, CompactStorage> CompactMaxDatarateSorter;
+
 
 #endif //SCHEDULER_MAXDATARATESORTER_HPP
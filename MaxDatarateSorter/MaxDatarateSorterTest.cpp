@@ -1,7 +1,14 @@
 #include <cppunit/TestFixture.h>
 #include <cppunit/extensions/HelperMacros.h>
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <sstream>
+#include <thread>
+#include "DoubleBufferedSorter.hpp"
 #include "MaxDatarateSorter.hpp"
+#include "WorkerPool.hpp"
 
 using namespace std;
 
@@ -53,6 +60,93 @@ class MaxDatarateSorterTest : public CppUnit::TestFixture {
       CPPUNIT_ASSERT_EQUAL(MacNodeId(1025), mSorter->get(1, 2).from);
     }
     
+    void testPutEqualRatesAndInterleavedReads() {
+      cout << "[MaxDatarateSorterTest/testPutEqualRatesAndInterleavedReads]" << endl;
+      MacCid dummyCid = 1;
+      mSorter->put(0, IdRatePair(dummyCid, 1025, 1, 26, 700, Direction::UL));
+      mSorter->put(0, IdRatePair(dummyCid, 1026, 1, 26, 700, Direction::UL));
+      mSorter->put(0, IdRatePair(dummyCid, 1027, 1, 26, 900, Direction::UL));
+      // Equal rates: the pair put last is ranked first.
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1027), mSorter->get(0, 0).from);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1026), mSorter->get(0, 1).from);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1025), mSorter->get(0, 2).from);
+      // Putting after a read must merge the new pairs into the sorted list.
+      mSorter->put(0, IdRatePair(dummyCid, 1028, 1, 26, 700, Direction::UL));
+      mSorter->put(0, IdRatePair(dummyCid, 1029, 1, 26, 1000, Direction::UL));
+      mSorter->put(0, IdRatePair(dummyCid, 1030, 1, 26, 100, Direction::UL));
+      const std::vector<IdRatePair>& pairs = mSorter->at(0);
+      CPPUNIT_ASSERT_EQUAL(size_t(6), pairs.size());
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1029), pairs.at(0).from);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1027), pairs.at(1).from);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1028), pairs.at(2).from);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1026), pairs.at(3).from);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1025), pairs.at(4).from);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1030), pairs.at(5).from);
+    }
+    
+    void testFinalize() {
+      cout << "[MaxDatarateSorterTest/testFinalize]" << endl;
+      MaxDatarateSorter serialSorter(numBands);
+      MacCid dummyCid = 1;
+      for (int round = 0; round < 2; round++) {
+        mSorter->clear();
+        serialSorter.clear();
+        for (MacNodeId id = 1025; id < 1125; id++) {
+          for (Band band = 0; band < numBands; band++) {
+            // Few distinct rates, so that there are plenty of ties.
+            double rate = double((id * 7 + band * 3 + round) % 11);
+            mSorter->put(band, IdRatePair(dummyCid, id, 1, 26, rate, Direction::UL));
+            serialSorter.put(band, IdRatePair(dummyCid, id, 1, 26, rate, Direction::UL));
+          }
+        }
+        mSorter->finalize(3);
+        serialSorter.finalize();
+        for (Band band = 0; band < numBands; band++) {
+          CPPUNIT_ASSERT_EQUAL(size_t(100), mSorter->at(band).size());
+          for (size_t i = 0; i < mSorter->at(band).size(); i++) {
+            CPPUNIT_ASSERT_EQUAL(serialSorter.get(band, i).from, mSorter->get(band, i).from);
+            if (i > 0)
+              CPPUNIT_ASSERT(mSorter->get(band, i - 1).rate >= mSorter->get(band, i).rate);
+          }
+        }
+      }
+    }
+    
+    void testFinalizeOnWorkerPool() {
+      cout << "[MaxDatarateSorterTest/testFinalizeOnWorkerPool]" << endl;
+      WorkerPool pool(4);
+      // Every task runs exactly once.
+      vector<int> numRuns(100, 0);
+      pool.run(numRuns.size(), [&numRuns](size_t task, size_t thread) { numRuns[task]++; });
+      CPPUNIT_ASSERT_EQUAL(size_t(100), size_t(count(numRuns.begin(), numRuns.end(), 1)));
+      
+      const Band manyBands = 37;
+      MaxDatarateSorter pooledSorter(manyBands), serialSorter(manyBands);
+      MacCid dummyCid = 1;
+      // The pool is reused across rounds.
+      for (int round = 0; round < 3; round++) {
+        pooledSorter.clear();
+        serialSorter.clear();
+        for (Band band = 0; band < manyBands; band++) {
+          // Bands of very different lengths.
+          for (MacNodeId id = 1025; id < 1025 + (band * 13) % 200; id++) {
+            double rate = double((id * 7 + band * 3 + round) % 11) / 3;
+            pooledSorter.put(band, IdRatePair(dummyCid, id, 1, 26, rate, Direction::UL));
+            serialSorter.put(band, IdRatePair(dummyCid, id, 1, 26, rate, Direction::UL));
+          }
+        }
+        pooledSorter.finalize(pool);
+        serialSorter.finalize();
+        for (Band band = 0; band < manyBands; band++) {
+          CPPUNIT_ASSERT_EQUAL(serialSorter.at(band).size(), pooledSorter.at(band).size());
+          for (size_t i = 0; i < pooledSorter.at(band).size(); i++) {
+            CPPUNIT_ASSERT_EQUAL(serialSorter.get(band, i).from, pooledSorter.get(band, i).from);
+            CPPUNIT_ASSERT_EQUAL(serialSorter.get(band, i).rate, pooledSorter.get(band, i).rate);
+          }
+        }
+      }
+    }
+    
     void testRemove() {
       cout << "[MaxDatarateSorterTest/testRemove]" << endl;
       // Add some nodes.
@@ -84,6 +178,94 @@ class MaxDatarateSorterTest : public CppUnit::TestFixture {
       }
     }
     
+    void testRemoveAdjacentPairs() {
+      cout << "[MaxDatarateSorterTest/testRemoveAdjacentPairs]" << endl;
+      // Node 1025 holds two neighbouring pairs on band 0, e.g. for an uplink and a D2D connection.
+      mSorter->put(0, IdRatePair(1, 1025, 1, 26, 1000, Direction::UL));
+      mSorter->put(0, IdRatePair(2, 1025, 1026, 24, 900, Direction::D2D));
+      mSorter->put(0, IdRatePair(3, 1027, 1, 26, 800, Direction::UL));
+      mSorter->put(0, IdRatePair(4, 1025, 1026, 24, 700, Direction::D2D));
+      mSorter->put(1, IdRatePair(5, 1027, 1, 26, 100, Direction::UL));
+      mSorter->remove(1025);
+      CPPUNIT_ASSERT_EQUAL(size_t(1), mSorter->at(0).size());
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1027), mSorter->get(0, 0).from);
+      CPPUNIT_ASSERT_EQUAL(size_t(1), mSorter->at(1).size());
+      bool seenException = false;
+      try {
+        mSorter->getBestBand(MacNodeId(1025));
+      } catch (const exception& e) {
+        seenException = true;
+      }
+      CPPUNIT_ASSERT_EQUAL(true, seenException);
+      CPPUNIT_ASSERT_EQUAL(Band(0), mSorter->getBestBand(MacNodeId(1027)));
+      // The node can be put again after its removal.
+      mSorter->put(1, IdRatePair(6, 1025, 1, 26, 50, Direction::UL));
+      CPPUNIT_ASSERT_EQUAL(Band(1), mSorter->getBestBand(MacNodeId(1025)));
+    }
+    
+    void testRemoveWithPendingPairs() {
+      cout << "[MaxDatarateSorterTest/testRemoveWithPendingPairs]" << endl;
+      MacCid dummyCid = 1;
+      mSorter->put(0, IdRatePair(dummyCid, 1025, 1, 26, 300, Direction::UL));
+      mSorter->put(0, IdRatePair(dummyCid, 1026, 1, 26, 200, Direction::UL));
+      mSorter->put(0, IdRatePair(dummyCid, 1025, 1, 26, 100, Direction::UL));
+      CPPUNIT_ASSERT_EQUAL(size_t(3), mSorter->at(0).size());
+      // 1025 now has pairs in the sorted part and among those put since.
+      mSorter->put(0, IdRatePair(dummyCid, 1025, 1, 26, 400, Direction::UL));
+      mSorter->put(0, IdRatePair(dummyCid, 1027, 1, 26, 200, Direction::UL));
+      mSorter->put(0, IdRatePair(dummyCid, 1025, 1, 26, 50, Direction::UL));
+      mSorter->remove(1025);
+      CPPUNIT_ASSERT_EQUAL(size_t(2), mSorter->at(0).size());
+      // The newer pair still wins the tie.
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1027), mSorter->get(0, 0).from);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1026), mSorter->get(0, 1).from);
+      Band band;
+      CPPUNIT_ASSERT_EQUAL(false, mSorter->tryGetBestBand(1025, band));
+      CPPUNIT_ASSERT_EQUAL(true, mSorter->tryGetBestBand(1027, band));
+    }
+    
+    void testUpdateRate() {
+      cout << "[MaxDatarateSorterTest/testUpdateRate]" << endl;
+      MacCid dummyCid = 1;
+      mSorter->put(0, IdRatePair(dummyCid, 1025, 1, 26, 1000, Direction::UL));
+      mSorter->put(0, IdRatePair(dummyCid, 1026, 1, 26, 800, Direction::UL));
+      mSorter->put(0, IdRatePair(dummyCid, 1027, 1, 26, 600, Direction::UL));
+      mSorter->put(0, IdRatePair(dummyCid, 1028, 1, 26, 400, Direction::UL));
+      mSorter->put(1, IdRatePair(dummyCid, 1028, 1, 26, 500, Direction::UL));
+      CPPUNIT_ASSERT_EQUAL(Band(1), mSorter->getBestBand(MacNodeId(1028)));
+      // Up to an equal rate: in front of the equal pair.
+      mSorter->updateRate(0, 1028, 800);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1025), mSorter->get(0, 0).from);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1028), mSorter->get(0, 1).from);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1026), mSorter->get(0, 2).from);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1027), mSorter->get(0, 3).from);
+      CPPUNIT_ASSERT_EQUAL(800.0, mSorter->get(0, 1).rate);
+      CPPUNIT_ASSERT_EQUAL(Band(0), mSorter->getBestBand(MacNodeId(1028)));
+      // Down to the last position.
+      mSorter->updateRate(0, 1025, 100);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1028), mSorter->get(0, 0).from);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1025), mSorter->get(0, 3).from);
+      // Several at once.
+      std::vector<RateUpdate> updates;
+      updates.push_back(RateUpdate(0, 1025, 2000));
+      updates.push_back(RateUpdate(1, 1028, 900));
+      mSorter->updateRates(updates);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1025), mSorter->get(0, 0).from);
+      CPPUNIT_ASSERT_EQUAL(Band(1), mSorter->getBestBand(MacNodeId(1028)));
+      // A missing pair is refused and no update of the batch is applied.
+      updates.clear();
+      updates.push_back(RateUpdate(0, 1026, 5000));
+      updates.push_back(RateUpdate(1, 1025, 1));
+      bool seenException = false;
+      try {
+        mSorter->updateRates(updates);
+      } catch (const exception& e) {
+        seenException = true;
+      }
+      CPPUNIT_ASSERT_EQUAL(true, seenException);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1025), mSorter->get(0, 0).from);
+    }
+    
     void testFindBestBand() {
       cout << "[MaxDatarateSorterTest/testFindBestBand]" << endl;
       bool seenException = false;
@@ -104,6 +286,32 @@ class MaxDatarateSorterTest : public CppUnit::TestFixture {
       CPPUNIT_ASSERT_EQUAL(Band(3), mSorter->getBestBand(MacNodeId(1025)));
     }
     
+    void testFindBestBandManyBands() {
+      cout << "[MaxDatarateSorterTest/testFindBestBandManyBands]" << endl;
+      // Not a multiple of the search's lanes, so that searching without a ranking has a remainder to go through.
+      const size_t manyBands = 53;
+      MaxDatarateSorter sorter(manyBands);
+      MacCid dummyCid = 1;
+      for (Band band = 0; band < manyBands; band++) {
+        sorter.put(band, IdRatePair(dummyCid, 1025, 1, 26, double((band * 17) % 50), Direction::UL));
+        sorter.put(band, IdRatePair(dummyCid, 1026, 1, 26, double(band), Direction::UL));
+      }
+      // Node 1025's rates are a permutation of 0..49 and repeat from band 50 on.
+      BandSet reassigned(manyBands);
+      CPPUNIT_ASSERT_EQUAL(Band(47), sorter.getBestBand(MacNodeId(1025), reassigned));
+      CPPUNIT_ASSERT_EQUAL(Band(52), sorter.getBestBand(MacNodeId(1026), reassigned));
+      reassigned.set(52, true);
+      CPPUNIT_ASSERT_EQUAL(Band(51), sorter.getBestBand(MacNodeId(1026), reassigned));
+      CPPUNIT_ASSERT_EQUAL(Band(47), sorter.getBestBand(MacNodeId(1025)));
+      CPPUNIT_ASSERT_EQUAL(Band(52), sorter.getBestBand(MacNodeId(1026)));
+      sorter.markBand(47, true);
+      sorter.markBand(52, true);
+      CPPUNIT_ASSERT_EQUAL(Band(44), sorter.getBestBand(MacNodeId(1025)));
+      CPPUNIT_ASSERT_EQUAL(Band(51), sorter.getBestBand(MacNodeId(1026)));
+      sorter.markBand(52, false);
+      CPPUNIT_ASSERT_EQUAL(Band(52), sorter.getBestBand(MacNodeId(1026)));
+    }
+    
     void testGetForDirection() {
       cout << "[MaxDatarateSorterTest/testGetForDirection]" << endl;
       MacCid dummyCid = 1;
@@ -154,6 +362,35 @@ class MaxDatarateSorterTest : public CppUnit::TestFixture {
         CPPUNIT_ASSERT(dir != pairs.at(i).dir);
     }
     
+    void testDirectionViews() {
+      cout << "[MaxDatarateSorterTest/testDirectionViews]" << endl;
+      MacCid dummyCid = 1;
+      mSorter->put(0, IdRatePair(dummyCid, 1025, 1, 26, 1000, Direction::UL));
+      mSorter->put(0, IdRatePair(dummyCid, 1026, 1026, 24, 600, Direction::D2D));
+      mSorter->put(0, IdRatePair(dummyCid, 1027, 1025, 24, 700, Direction::D2D));
+      mSorter->put(0, IdRatePair(dummyCid, 1028, 1, 26, 500, Direction::UL));
+      mSorter->put(0, IdRatePair(dummyCid, 1029, 1, 26, 800, Direction::DL));
+      
+      DirectionView d2dPairs = mSorter->at(0, Direction::D2D);
+      CPPUNIT_ASSERT_EQUAL(size_t(2), d2dPairs.size());
+      DirectionView::const_iterator it = d2dPairs.begin();
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1027), it->from);
+      it++;
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1026), it->from);
+      it++;
+      CPPUNIT_ASSERT(it == d2dPairs.end());
+      
+      // Non-D2D pairs keep their rate order as well.
+      MacNodeId expected[] = {1025, 1029, 1028};
+      size_t i = 0;
+      for (const IdRatePair& pair : mSorter->at_nonD2D(0))
+        CPPUNIT_ASSERT_EQUAL(expected[i++], pair.from);
+      CPPUNIT_ASSERT_EQUAL(size_t(3), i);
+      
+      CPPUNIT_ASSERT(mSorter->at(0, Direction::D2D_MULTI).empty());
+      CPPUNIT_ASSERT(mSorter->at(1, Direction::UL).empty());
+    }
+    
     void testRemoveBand() {
       cout << "[MaxDatarateSorterTest/testRemoveBand]" << endl;
       MacCid dummyCid = 1;
@@ -175,6 +412,91 @@ class MaxDatarateSorterTest : public CppUnit::TestFixture {
       CPPUNIT_ASSERT_EQUAL(true, seenException);
     }
     
+    void testReassignmentLoop() {
+      cout << "[MaxDatarateSorterTest/testReassignmentLoop]" << endl;
+      const size_t manyBands = 50;
+      MaxDatarateSorter sorter(manyBands);
+      MacCid dummyCid = 1;
+      for (Band band = 0; band < manyBands; band++)
+        sorter.put(band, IdRatePair(dummyCid, 1025, 1, 26, double((band * 17) % 50), Direction::UL));
+      // Taking away the best band each time must yield the bands in descending rate order.
+      for (int rate = 49; rate >= 0; rate--) {
+        Band band = sorter.getBestBand(MacNodeId(1025));
+        CPPUNIT_ASSERT_EQUAL(double(rate), sorter.at(band).at(0).rate);
+        sorter.markBand(band, true);
+        // Half way through, give back a band that has been taken away before.
+        if (rate == 25) {
+          sorter.markBand(Band(47), false); // Rate 49.
+          CPPUNIT_ASSERT_EQUAL(Band(47), sorter.getBestBand(MacNodeId(1025)));
+          sorter.markBand(Band(47), true);
+        }
+      }
+      bool seenException = false;
+      try {
+        sorter.getBestBand(MacNodeId(1025));
+      } catch (const exception& e) {
+        seenException = true;
+      }
+      CPPUNIT_ASSERT_EQUAL(true, seenException);
+    }
+    
+    void testMarkBandCoversLaterPairs() {
+      cout << "[MaxDatarateSorterTest/testMarkBandCoversLaterPairs]" << endl;
+      MacCid dummyCid = 1;
+      mSorter->put(0, IdRatePair(dummyCid, 1025, 1026, 24, 700, Direction::D2D));
+      mSorter->markBand(1, true);
+      CPPUNIT_ASSERT_EQUAL(true, mSorter->isReassigned(1));
+      CPPUNIT_ASSERT_EQUAL(false, mSorter->isReassigned(0));
+      // A pair put into an already marked band is not considered either.
+      mSorter->put(1, IdRatePair(dummyCid, 1025, 1026, 24, 900, Direction::D2D));
+      CPPUNIT_ASSERT_EQUAL(Band(0), mSorter->getBestBand(MacNodeId(1025)));
+      mSorter->markBand(1, false);
+      CPPUNIT_ASSERT_EQUAL(false, mSorter->isReassigned(1));
+      CPPUNIT_ASSERT_EQUAL(Band(1), mSorter->getBestBand(MacNodeId(1025)));
+    }
+    
+    void testMetrics() {
+      cout << "[MaxDatarateSorterTest/testMetrics]" << endl;
+      MacCid dummyCid = 1;
+      ProportionalFairMetric proportionalFair;
+      proportionalFair.setAverageThroughput(1025, 1000);
+      proportionalFair.setAverageThroughput(1026, 100);
+      BandSorter<ProportionalFairMetric> pfSorter(2, proportionalFair);
+      pfSorter.put(0, IdRatePair(dummyCid, 1025, 1, 26, 1000, Direction::UL)); // 1
+      pfSorter.put(0, IdRatePair(dummyCid, 1026, 1, 26, 500, Direction::UL)); // 5
+      pfSorter.put(0, IdRatePair(dummyCid, 1027, 1, 26, 2, Direction::UL)); // No average, so 2.
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1026), pfSorter.get(0, 0).from);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1027), pfSorter.get(0, 1).from);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1025), pfSorter.get(0, 2).from);
+      // Updating the rate re-ranks by the new ratio.
+      pfSorter.updateRate(0, 1025, 10000);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1025), pfSorter.get(0, 0).from);
+      // A new average re-sorts the pairs that are held.
+      pfSorter.put(1, IdRatePair(dummyCid, 1025, 1, 26, 5000, Direction::UL)); // 5
+      CPPUNIT_ASSERT_EQUAL(Band(0), pfSorter.getBestBand(1025));
+      proportionalFair.setAverageThroughput(1025, 100000);
+      proportionalFair.setAverageThroughput(1026, 1000);
+      pfSorter.setMetric(proportionalFair);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1027), pfSorter.get(0, 0).from);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1026), pfSorter.get(0, 1).from);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1025), pfSorter.get(0, 2).from);
+      CPPUNIT_ASSERT_EQUAL(size_t(2), pfSorter.rankOf(0, 1025));
+      CPPUNIT_ASSERT_EQUAL(Band(0), pfSorter.getBestBand(1025));
+      pfSorter.updateRate(1, 1025, 50000000);
+      CPPUNIT_ASSERT_EQUAL(Band(1), pfSorter.getBestBand(1025));
+
+      DeficitMetric deficit;
+      deficit.setDeficit(1025, 10);
+      deficit.setDeficit(1026, 30);
+      BandSorter<DeficitMetric> drrSorter(2, deficit);
+      drrSorter.put(0, IdRatePair(dummyCid, 1025, 1, 26, 1000, Direction::UL));
+      drrSorter.put(1, IdRatePair(dummyCid, 1025, 1, 26, 10, Direction::UL));
+      drrSorter.put(1, IdRatePair(dummyCid, 1026, 1, 26, 1, Direction::UL));
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1026), drrSorter.get(1, 0).from);
+      // The deficit is the same on all bands, the lowest of them wins.
+      CPPUNIT_ASSERT_EQUAL(Band(0), drrSorter.getBestBand(1025));
+    }
+    
     void testToStringWithPrefix() {
       cout << "[MaxDatarateSorterTest/testToStringWithPrefix]" << endl;
       MacCid dummyCid = 1;
@@ -184,13 +506,457 @@ class MaxDatarateSorterTest : public CppUnit::TestFixture {
       cout << mSorter->toString("LteMaxDatarate ") << endl;
     }
     
+    void testFixedCapacity() {
+      cout << "[MaxDatarateSorterTest/testFixedCapacity]" << endl;
+      MacCid dummyCid = 1;
+      const size_t maxPairs = 40;
+      MaxDatarateSorter sorter(2, maxPairs);
+      for (size_t i = 0; i < maxPairs; i++)
+        sorter.put(0, IdRatePair(dummyCid, MacNodeId(1025 + i), 1, 26, double(i % 7), Direction::UL));
+      bool seenException = false;
+      try {
+        sorter.put(0, IdRatePair(dummyCid, 2000, 1, 26, 1, Direction::UL));
+      } catch (const length_error& e) {
+        seenException = true;
+      }
+      CPPUNIT_ASSERT_EQUAL(true, seenException);
+      sorter.finalize();
+      // Sorted descending, newest first among equal rates.
+      const vector<IdRatePair>& list = sorter.at(0);
+      CPPUNIT_ASSERT_EQUAL(maxPairs, list.size());
+      for (size_t i = 1; i < list.size(); i++) {
+        CPPUNIT_ASSERT(list.at(i - 1).rate >= list.at(i).rate);
+        if (list.at(i - 1).rate == list.at(i).rate)
+          CPPUNIT_ASSERT(list.at(i - 1).from > list.at(i).from);
+      }
+      CPPUNIT_ASSERT(list.capacity() >= maxPairs);
+      
+      // Nodes from before clear() are gone, even though their entries are kept.
+      sorter.clear();
+      CPPUNIT_ASSERT_EQUAL(true, sorter.at(0).empty());
+      CPPUNIT_ASSERT(sorter.at(0).capacity() >= maxPairs);
+      sorter.put(1, IdRatePair(dummyCid, 1025, 1, 26, 5, Direction::UL));
+      CPPUNIT_ASSERT_EQUAL(Band(1), sorter.getBestBand(1025));
+      seenException = false;
+      try {
+        sorter.getBestBand(1026);
+      } catch (const exception& e) {
+        seenException = true;
+      }
+      CPPUNIT_ASSERT_EQUAL(true, seenException);
+    }
+    
+    void testTopK() {
+      cout << "[MaxDatarateSorterTest/testTopK]" << endl;
+      MacCid dummyCid = 1;
+      mSorter->put(0, IdRatePair(dummyCid, 1025, 1, 26, 300, Direction::UL));
+      mSorter->put(0, IdRatePair(dummyCid, 1026, 1, 26, 100, Direction::UL));
+      mSorter->put(2, IdRatePair(dummyCid, 1025, 1, 26, 200, Direction::UL));
+      mSorter->put(2, IdRatePair(dummyCid, 1027, 1, 26, 300, Direction::UL));
+      mSorter->put(4, IdRatePair(dummyCid, 1028, 1, 26, 50, Direction::UL));
+      vector<pair<Band, IdRatePair>> best = mSorter->topK(3);
+      CPPUNIT_ASSERT_EQUAL(size_t(3), best.size());
+      // Equal keys: the lower band first.
+      CPPUNIT_ASSERT_EQUAL(Band(0), best.at(0).first);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1025), best.at(0).second.from);
+      CPPUNIT_ASSERT_EQUAL(Band(2), best.at(1).first);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1027), best.at(1).second.from);
+      CPPUNIT_ASSERT_EQUAL(Band(2), best.at(2).first);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1025), best.at(2).second.from);
+      CPPUNIT_ASSERT_EQUAL(size_t(5), mSorter->topK(10).size());
+      
+      // The iterator visits everything in descending order.
+      double previous = numeric_limits<double>::infinity();
+      size_t numVisited = 0;
+      for (MaxDatarateSorter::GlobalIterator it = mSorter->globalBegin(); it != mSorter->globalEnd(); ++it) {
+        CPPUNIT_ASSERT(it->rate <= previous);
+        CPPUNIT_ASSERT_EQUAL(it->from, mSorter->get(it.band(), it.position()).from);
+        previous = it->rate;
+        numVisited++;
+      }
+      CPPUNIT_ASSERT_EQUAL(size_t(5), numVisited);
+      mSorter->clear();
+      CPPUNIT_ASSERT_EQUAL(true, mSorter->globalBegin() == mSorter->globalEnd());
+    }
+    
+    void testGetBestBands() {
+      cout << "[MaxDatarateSorterTest/testGetBestBands]" << endl;
+      MacCid dummyCid = 1;
+      mSorter->put(0, IdRatePair(dummyCid, 1025, 1, 26, 100, Direction::UL));
+      mSorter->put(1, IdRatePair(dummyCid, 1025, 1, 26, 400, Direction::UL));
+      mSorter->put(2, IdRatePair(dummyCid, 1025, 1, 26, 200, Direction::UL));
+      mSorter->put(3, IdRatePair(dummyCid, 1025, 1, 26, 300, Direction::UL));
+      vector<Band> bands = mSorter->getBestBands(1025, 3);
+      CPPUNIT_ASSERT_EQUAL(size_t(3), bands.size());
+      CPPUNIT_ASSERT_EQUAL(Band(1), bands.at(0));
+      CPPUNIT_ASSERT_EQUAL(Band(3), bands.at(1));
+      CPPUNIT_ASSERT_EQUAL(Band(2), bands.at(2));
+      // Marked bands are skipped, wherever they are in the ranking.
+      mSorter->markBand(1, true);
+      mSorter->markBand(2, true);
+      bands = mSorter->getBestBands(1025, 10);
+      CPPUNIT_ASSERT_EQUAL(size_t(2), bands.size());
+      CPPUNIT_ASSERT_EQUAL(Band(3), bands.at(0));
+      CPPUNIT_ASSERT_EQUAL(Band(0), bands.at(1));
+      CPPUNIT_ASSERT_EQUAL(true, mSorter->getBestBands(1026, 2).empty());
+      
+      Band band = 42;
+      CPPUNIT_ASSERT_EQUAL(true, mSorter->tryGetBestBand(1025, band));
+      CPPUNIT_ASSERT_EQUAL(Band(3), band);
+      mSorter->markBand(3, true);
+      mSorter->markBand(0, true);
+      CPPUNIT_ASSERT_EQUAL(false, mSorter->tryGetBestBand(1025, band));
+      CPPUNIT_ASSERT_EQUAL(false, mSorter->tryGetBestBand(1026, band));
+      CPPUNIT_ASSERT_EQUAL(true, mSorter->getBestBands(1025, 2).empty());
+      
+      // Bands beyond the container's are refused, also within the bits of the last word.
+      bool seenException = false;
+      try {
+        mSorter->markBand(Band(numBands), true);
+      } catch (const out_of_range& e) {
+        seenException = true;
+      }
+      CPPUNIT_ASSERT_EQUAL(true, seenException);
+    }
+    
+    void testGetBestBandPerReader() {
+      cout << "[MaxDatarateSorterTest/testGetBestBandPerReader]" << endl;
+      MacCid dummyCid = 1;
+      mSorter->put(0, IdRatePair(dummyCid, 1025, 1, 26, 100, Direction::UL));
+      mSorter->put(1, IdRatePair(dummyCid, 1025, 1, 26, 400, Direction::UL));
+      mSorter->put(2, IdRatePair(dummyCid, 1025, 1, 26, 200, Direction::UL));
+      mSorter->put(3, IdRatePair(dummyCid, 1025, 1, 26, 400, Direction::UL));
+      BandSet reassigned(numBands);
+      // Before finalize() the node's bands are scanned, with the same tie-break as the ranking.
+      CPPUNIT_ASSERT_EQUAL(Band(1), mSorter->getBestBand(1025, reassigned));
+      mSorter->finalize();
+      mSorter->markBand(1, true);
+      reassigned.set(3, true);
+      CPPUNIT_ASSERT_EQUAL(Band(2), mSorter->getBestBand(1025, reassigned));
+      // Another reader's set doesn't affect the container.
+      CPPUNIT_ASSERT_EQUAL(Band(3), mSorter->getBestBand(1025));
+      reassigned.set(2, true);
+      reassigned.set(0, true);
+      Band band = 42;
+      CPPUNIT_ASSERT_EQUAL(false, mSorter->tryGetBestBand(1025, reassigned, band));
+      CPPUNIT_ASSERT_EQUAL(false, mSorter->tryGetBestBand(1026, reassigned, band));
+      // Unmarked bands are considered again.
+      mSorter->markBand(1, false);
+      CPPUNIT_ASSERT_EQUAL(Band(1), mSorter->getBestBand(1025, reassigned));
+      bool seenException = false;
+      try {
+        mSorter->getBestBand(1026, reassigned);
+      } catch (const runtime_error& e) {
+        seenException = true;
+      }
+      CPPUNIT_ASSERT_EQUAL(true, seenException);
+    }
+    
+    void testRankOf() {
+      cout << "[MaxDatarateSorterTest/testRankOf]" << endl;
+      MacCid dummyCid = 1;
+      mSorter->put(0, IdRatePair(dummyCid, 1025, 1, 26, 100, Direction::UL));
+      mSorter->put(0, IdRatePair(dummyCid, 1026, 1, 26, 300, Direction::UL));
+      mSorter->put(0, IdRatePair(dummyCid, 1027, 1, 26, 200, Direction::DL));
+      mSorter->put(0, IdRatePair(dummyCid, 1028, 1, 26, 200, Direction::UL));
+      mSorter->put(0, IdRatePair(dummyCid, 1025, 1, 26, 50, Direction::DL));
+      for (size_t position = 0; position < 4; position++)
+        CPPUNIT_ASSERT_EQUAL(position, mSorter->rankOf(0, mSorter->get(0, position).from));
+      // A node with several pairs is ranked by its best one.
+      CPPUNIT_ASSERT_EQUAL(size_t(3), mSorter->rankOf(0, 1025));
+      mSorter->updateRate(0, 1025, 1000);
+      CPPUNIT_ASSERT_EQUAL(size_t(0), mSorter->rankOf(0, 1025));
+      bool seenException = false;
+      try {
+        mSorter->rankOf(1, 1025);
+      } catch (const invalid_argument& e) {
+        seenException = true;
+      }
+      CPPUNIT_ASSERT_EQUAL(true, seenException);
+      
+      // Ties are broken by when a pair was put, so positions among equal rates are found exactly.
+      for (MacNodeId id = 1100; id < 1140; id++)
+        mSorter->put(1, IdRatePair(dummyCid, id, 1, 26, 7, Direction::UL));
+      for (size_t position = 0; position < 40; position++)
+        CPPUNIT_ASSERT_EQUAL(position, mSorter->rankOf(1, mSorter->get(1, position).from));
+      // An update to an equal rate moves the pair in front of the others, like a new one.
+      mSorter->updateRate(1, 1100, 7);
+      CPPUNIT_ASSERT_EQUAL(size_t(0), mSorter->rankOf(1, 1100));
+      CPPUNIT_ASSERT_EQUAL(size_t(1), mSorter->rankOf(1, 1139));
+    }
+    
+    void testRange() {
+      cout << "[MaxDatarateSorterTest/testRange]" << endl;
+      MacCid dummyCid = 1;
+      mSorter->put(0, IdRatePair(dummyCid, 1025, 1, 26, 100, Direction::UL));
+      mSorter->put(0, IdRatePair(dummyCid, 1026, 1, 26, 300, Direction::D2D));
+      mSorter->put(0, IdRatePair(dummyCid, 1027, 1, 26, 200, Direction::UL));
+      mSorter->put(0, IdRatePair(dummyCid, 1028, 1, 26, 200, Direction::D2D));
+      PairRange above = mSorter->range(0, 200);
+      CPPUNIT_ASSERT_EQUAL(size_t(3), above.size());
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1026), above[0].from);
+      for (const IdRatePair& pair : above)
+        CPPUNIT_ASSERT(pair.rate >= 200);
+      CPPUNIT_ASSERT_EQUAL(size_t(4), mSorter->range(0, 0).size());
+      CPPUNIT_ASSERT_EQUAL(true, mSorter->range(0, 301).empty());
+      CPPUNIT_ASSERT_EQUAL(true, mSorter->range(1, 0).empty());
+      // Nothing is copied.
+      CPPUNIT_ASSERT_EQUAL(&mSorter->get(0, 0), above.begin());
+      
+      vector<IdRatePair> d2d = mSorter->range(0, 200, Direction::D2D);
+      CPPUNIT_ASSERT_EQUAL(size_t(2), d2d.size());
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1026), d2d.at(0).from);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1028), d2d.at(1).from);
+      CPPUNIT_ASSERT_EQUAL(size_t(1), mSorter->range(0, 250, Direction::D2D).size());
+    }
+    
+    void testDoubleBuffered() {
+      cout << "[MaxDatarateSorterTest/testDoubleBuffered]" << endl;
+      const size_t numTTIs = 200, numNodes = 20;
+      DoubleBufferedMaxDatarateSorter sorters(numBands);
+      CPPUNIT_ASSERT_EQUAL(true, sorters.acquire()->at(0).empty());
+      // The producer tags each TTI's pairs with the TTI as connection id.
+      thread producer([&sorters, numTTIs, numNodes, this]() {
+        for (MacCid tti = 1; tti <= numTTIs; tti++) {
+          MaxDatarateSorter& back = sorters.back();
+          back.clear();
+          for (Band band = 0; band < numBands; band++)
+            for (MacNodeId node = 0; node < numNodes; node++)
+              back.put(band, IdRatePair(tti, 1025 + node, 1, 26, double((node * 7 + band + tti) % 11), Direction::UL));
+          sorters.publish();
+        }
+      });
+      // Readers only ever see complete TTIs, and never an older one than before.
+      bool consistent = true;
+      MacCid lastSeen = 0;
+      while (lastSeen < numTTIs) {
+        DoubleBufferedMaxDatarateSorter::Snapshot snapshot = sorters.acquire();
+        if (snapshot->at(0).empty())
+          continue;
+        const MacCid tti = snapshot->get(0, 0).connectionId;
+        consistent = consistent && tti >= lastSeen;
+        for (Band band = 0; band < numBands; band++) {
+          consistent = consistent && snapshot->at(band).size() == numNodes;
+          for (const IdRatePair& pair : snapshot->at(band))
+            consistent = consistent && pair.connectionId == tti;
+        }
+        // A reassignment loop on the snapshot, with its own set of reassigned bands.
+        BandSet reassigned(numBands);
+        Band best;
+        size_t numAssigned = 0;
+        while (snapshot->tryGetBestBand(1025, reassigned, best)) {
+          consistent = consistent && !reassigned.test(best);
+          reassigned.set(best, true);
+          numAssigned++;
+        }
+        consistent = consistent && numAssigned == size_t(numBands);
+        lastSeen = tti;
+      }
+      producer.join();
+      CPPUNIT_ASSERT_EQUAL(true, consistent);
+      
+      // Both buffers store pairs with the storage given.
+      DoubleBufferedSorter<RateMetric, CompactStorage> compactSorters(1, 0, CompactStorage(PairCodec(0.5)));
+      for (int tti = 0; tti < 2; tti++) {
+        CompactMaxDatarateSorter& back = compactSorters.back();
+        CPPUNIT_ASSERT_EQUAL(0.5, back.getStorage().getCodec().getRateResolution());
+        back.clear();
+        back.put(0, IdRatePair(1, 1025, 1, 26, 10.1, Direction::UL));
+        compactSorters.publish();
+        CPPUNIT_ASSERT_EQUAL(10.0, compactSorters.acquire()->get(0, 0).rate);
+      }
+    }
+    
+    void testCompactPairs() {
+      cout << "[MaxDatarateSorterTest/testCompactPairs]" << endl;
+      CPPUNIT_ASSERT_EQUAL(size_t(16), sizeof(CompactIdRatePair));
+      MacCid dummyCid = 1;
+      // By default pairs are stored as they are put.
+      mSorter->put(0, IdRatePair(dummyCid, 1025, 1, 26, 0.1, Direction::UL));
+      mSorter->put(0, IdRatePair(dummyCid, 1026, 1, 26, 16777217, Direction::UL));
+      CPPUNIT_ASSERT_EQUAL(16777217.0, mSorter->get(0, 0).rate);
+      CPPUNIT_ASSERT_EQUAL(0.1, mSorter->get(0, 1).rate);
+      
+      // Compact pairs store everything but the rate exactly.
+      CompactMaxDatarateSorter compactSorter(1);
+      compactSorter.put(0, IdRatePair(dummyCid, 1025, 1026, 24.15, 0.1, Direction::D2D_MULTI));
+      const IdRatePair stored = compactSorter.get(0, 0);
+      CPPUNIT_ASSERT_EQUAL(dummyCid, stored.connectionId);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1026), stored.to);
+      CPPUNIT_ASSERT_EQUAL(24.15, stored.txPower);
+      CPPUNIT_ASSERT_EQUAL(Direction::D2D_MULTI, stored.dir);
+      // By default their rates are floats.
+      CPPUNIT_ASSERT_EQUAL(double(0.1f), stored.rate);
+      CPPUNIT_ASSERT_EQUAL(double(0.1f), compactSorter.getStorage().getCodec().round(0.1));
+      
+      // Fixed-point rates are rounded to the resolution, which may make them tie.
+      CompactMaxDatarateSorter fixedSorter(1, 0, CompactStorage(PairCodec(0.5)));
+      fixedSorter.put(0, IdRatePair(dummyCid, 1025, 1, 26, 10.1, Direction::UL));
+      fixedSorter.put(0, IdRatePair(dummyCid, 1026, 1, 26, 9.9, Direction::UL));
+      CPPUNIT_ASSERT_EQUAL(10.0, fixedSorter.get(0, 0).rate);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1026), fixedSorter.get(0, 0).from);
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1026), fixedSorter.topK(1).at(0).second.from);
+      bool seenException = false;
+      try {
+        fixedSorter.updateRate(0, 1025, -1);
+      } catch (const invalid_argument& e) {
+        seenException = true;
+      }
+      CPPUNIT_ASSERT_EQUAL(true, seenException);
+      CPPUNIT_ASSERT_EQUAL(10.0, fixedSorter.get(0, 1).rate);
+      
+      // Binary records carry the codec, and are only read by a sorter of the same storage.
+      stringstream binary;
+      fixedSorter.writeBinary(binary);
+      compactSorter.readBinary(binary);
+      CPPUNIT_ASSERT_EQUAL(fixedSorter.toString(), compactSorter.toString());
+      CPPUNIT_ASSERT_EQUAL(0.5, compactSorter.getStorage().getCodec().getRateResolution());
+      binary.seekg(0);
+      seenException = false;
+      try {
+        MaxDatarateSorter(1).readBinary(binary);
+      } catch (const runtime_error& e) {
+        seenException = true;
+      }
+      CPPUNIT_ASSERT_EQUAL(true, seenException);
+      
+      // The tx power table is bounded.
+      seenException = false;
+      try {
+        for (size_t i = 0; i <= PairCodec::MAX_TX_POWERS; i++)
+          fixedSorter.put(0, IdRatePair(dummyCid, 1027, 1, double(i), 1, Direction::UL));
+      } catch (const length_error& e) {
+        seenException = true;
+      }
+      CPPUNIT_ASSERT_EQUAL(true, seenException);
+    }
+    
+    void testWrite() {
+      cout << "[MaxDatarateSorterTest/testWrite]" << endl;
+      MacCid dummyCid = 1;
+      mSorter->put(0, IdRatePair(dummyCid, 1025, 1026, 24.15, 700.25, Direction::D2D));
+      mSorter->put(0, IdRatePair(dummyCid, 1027, 1, 26, 0, Direction::UL));
+      mSorter->put(3, IdRatePair(dummyCid, 1028, 1, 26, 123456.5, Direction::UNKNOWN_DIRECTION));
+      mSorter->markBand(3, true);
+      ostringstream out;
+      mSorter->write(out, "> ");
+      const string expected = "> Band 0:\n"
+                              "> \t1025-D2D->1026 @24.150000 with throughput 700.250000\n"
+                              "> \t1027-UL->1 @26.000000 with throughput 0.000000\n"
+                              "> Band 1:\n> Band 2:\n> Band 3:\n"
+                              "> \t1028-Unrecognized->1 @26.000000 with throughput 123456.500000\n"
+                              "> Band 4:\n";
+      CPPUNIT_ASSERT_EQUAL(expected, out.str());
+      CPPUNIT_ASSERT_EQUAL("\n" + expected, mSorter->toString("> "));
+      
+      ostringstream binary;
+      mSorter->writeBinary(binary);
+      const string bytes = binary.str();
+      CPPUNIT_ASSERT_EQUAL(string("MDRS"), bytes.substr(0, 4));
+      // Header with the storage, pair counts, three pairs and one word of marked bands.
+      CPPUNIT_ASSERT_EQUAL(size_t(32), sizeof(IdRatePairRecord));
+      const size_t header = 4 + 2 + 2 + 1;
+      CPPUNIT_ASSERT_EQUAL(header + 5 * 4 + 3 * sizeof(IdRatePairRecord) + 8, bytes.size());
+      uint64_t marked;
+      memcpy(&marked, bytes.data() + bytes.size() - 8, 8);
+      CPPUNIT_ASSERT_EQUAL(uint64_t(1) << 3, marked);
+    }
+    
+    void testBinarySnapshots() {
+      cout << "[MaxDatarateSorterTest/testBinarySnapshots]" << endl;
+      MacCid dummyCid = 1;
+      for (MacNodeId id = 1025; id < 1045; id++)
+        for (Band band = 0; band < numBands; band++)
+          mSorter->put(band, IdRatePair(dummyCid, id, 1, id % 2 ? 26 : 24.15, double((id * 7 + band) % 13), id % 3 ? Direction::UL : Direction::D2D));
+      mSorter->markBand(2, true);
+      stringstream snapshot;
+      mSorter->writeBinary(snapshot);
+      MaxDatarateSorter replayed(numBands);
+      replayed.put(0, IdRatePair(dummyCid, 2000, 1, 10, 1, Direction::DL));
+      replayed.readBinary(snapshot);
+      CPPUNIT_ASSERT_EQUAL(mSorter->toString(), replayed.toString());
+      CPPUNIT_ASSERT_EQUAL(true, replayed.isReassigned(2));
+      CPPUNIT_ASSERT_EQUAL(mSorter->getBestBand(1030), replayed.getBestBand(1030));
+      CPPUNIT_ASSERT_EQUAL(true, replayed.getBestBands(2000, 1).empty());
+      
+      // A log of deltas replays TTI by TTI, and a TTI with few changes takes little space.
+      stringstream log;
+      mSorter->writeBinaryDelta(log);
+      const size_t fullSize = log.str().size();
+      mSorter->updateRate(0, 1030, 100);
+      mSorter->remove(1031);
+      mSorter->markBand(2, false);
+      mSorter->put(4, IdRatePair(dummyCid, 1050, 1, 26, 5, Direction::UL));
+      mSorter->writeBinaryDelta(log);
+      CPPUNIT_ASSERT(log.str().size() - fullSize < fullSize / 2);
+      MaxDatarateSorter deltaReplayed(numBands, 40);
+      deltaReplayed.readBinary(log);
+      const IdRatePair* firstPair = deltaReplayed.at(0).data();
+      deltaReplayed.readBinary(log);
+      CPPUNIT_ASSERT_EQUAL(mSorter->toString(), deltaReplayed.toString());
+      // The delta is applied within the band's own memory.
+      CPPUNIT_ASSERT_EQUAL(firstPair, deltaReplayed.at(0).data());
+      CPPUNIT_ASSERT_EQUAL(false, deltaReplayed.isReassigned(2));
+      CPPUNIT_ASSERT_EQUAL(Band(0), deltaReplayed.getBestBand(1030));
+      CPPUNIT_ASSERT_EQUAL(Band(4), deltaReplayed.getBestBand(1050));
+      
+      bool seenException = false;
+      try {
+        snapshot.clear();
+        snapshot.seekg(0);
+        MaxDatarateSorter otherBands(numBands + 1);
+        otherBands.readBinary(snapshot);
+      } catch (const runtime_error& e) {
+        seenException = true;
+      }
+      CPPUNIT_ASSERT_EQUAL(true, seenException);
+      
+      // A record cut off within a band's pairs, as after a crash, leaves an empty but usable container.
+      const string full = snapshot.str();
+      stringstream truncated(full.substr(0, full.size() / 2));
+      seenException = false;
+      try {
+        replayed.readBinary(truncated);
+      } catch (const runtime_error& e) {
+        seenException = true;
+      }
+      CPPUNIT_ASSERT_EQUAL(true, seenException);
+      for (Band band = 0; band < numBands; band++)
+        CPPUNIT_ASSERT_EQUAL(true, replayed.at(band).empty());
+      Band band;
+      CPPUNIT_ASSERT_EQUAL(false, replayed.tryGetBestBand(1030, band));
+      replayed.put(0, IdRatePair(dummyCid, 1030, 1, 26, 1, Direction::UL));
+      CPPUNIT_ASSERT_EQUAL(MacNodeId(1030), replayed.get(0, 0).from);
+    }
+    
     CPPUNIT_TEST_SUITE(MaxDatarateSorterTest);
       CPPUNIT_TEST(testPut);
+      CPPUNIT_TEST(testPutEqualRatesAndInterleavedReads);
+      CPPUNIT_TEST(testFinalize);
+      CPPUNIT_TEST(testFinalizeOnWorkerPool);
       CPPUNIT_TEST(testRemove);
+      CPPUNIT_TEST(testRemoveAdjacentPairs);
+      CPPUNIT_TEST(testRemoveWithPendingPairs);
+      CPPUNIT_TEST(testUpdateRate);
       CPPUNIT_TEST(testFindBestBand);
+      CPPUNIT_TEST(testFindBestBandManyBands);
       CPPUNIT_TEST(testGetForDirection);
       CPPUNIT_TEST(testGetForNonD2D);
+      CPPUNIT_TEST(testDirectionViews);
       CPPUNIT_TEST(testRemoveBand);
+      CPPUNIT_TEST(testReassignmentLoop);
+      CPPUNIT_TEST(testMarkBandCoversLaterPairs);
+      CPPUNIT_TEST(testMetrics);
       CPPUNIT_TEST(testToStringWithPrefix);
+      CPPUNIT_TEST(testFixedCapacity);
+      CPPUNIT_TEST(testTopK);
+      CPPUNIT_TEST(testGetBestBands);
+      CPPUNIT_TEST(testGetBestBandPerReader);
+      CPPUNIT_TEST(testRankOf);
+      CPPUNIT_TEST(testRange);
+      CPPUNIT_TEST(testDoubleBuffered);
+      CPPUNIT_TEST(testCompactPairs);
+      CPPUNIT_TEST(testWrite);
+      CPPUNIT_TEST(testBinarySnapshots);
     CPPUNIT_TEST_SUITE_END();
 };
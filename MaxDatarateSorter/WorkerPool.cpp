@@ -0,0 +1,63 @@
+#include "WorkerPool.hpp"
+
+WorkerPool::WorkerPool(const size_t numThreads) : mJob(0), mNumBusy(0), mStopping(false), mTask(nullptr), mNumTasks(0), mNextTask(0) {
+  // The thread calling run() works as well.
+  for (size_t thread = 1; thread < numThreads; thread++)
+    mWorkers.push_back(std::thread(&WorkerPool::work, this, thread));
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStopping = true;
+  }
+  mJobStarted.notify_all();
+  for (size_t i = 0; i < mWorkers.size(); i++)
+    mWorkers.at(i).join();
+}
+
+void WorkerPool::run(const size_t numTasks, const std::function<void(size_t, size_t)>& task) {
+  if (mWorkers.empty() || numTasks <= 1) {
+    for (size_t i = 0; i < numTasks; i++)
+      task(i, 0);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mTask = &task;
+    mNumTasks = numTasks;
+    mNextTask = 0;
+    mNumBusy = mWorkers.size();
+    mJob++;
+  }
+  mJobStarted.notify_all();
+  claimTasks(0);
+  // Workers may still be running their last task.
+  std::unique_lock<std::mutex> lock(mMutex);
+  mJobDone.wait(lock, [this]() { return mNumBusy == 0; });
+  mTask = nullptr;
+}
+
+void WorkerPool::work(const size_t thread) {
+  unsigned long lastJob = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mMutex);
+      mJobStarted.wait(lock, [this, lastJob]() { return mStopping || mJob != lastJob; });
+      if (mStopping)
+        return;
+      lastJob = mJob;
+    }
+    claimTasks(thread);
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mNumBusy--;
+    }
+    mJobDone.notify_one();
+  }
+}
+
+void WorkerPool::claimTasks(const size_t thread) {
+  for (size_t i = mNextTask.fetch_add(1); i < mNumTasks; i = mNextTask.fetch_add(1))
+    (*mTask)(i, thread);
+}
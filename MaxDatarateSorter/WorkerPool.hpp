@@ -0,0 +1,66 @@
+#ifndef SCHEDULER_WORKERPOOL_HPP
+#define SCHEDULER_WORKERPOOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of threads that is kept alive between jobs, so that starting a job doesn't
+ * create threads. A job is a number of independent tasks. Idle threads claim the next task
+ * from a shared counter, so a thread that drew short tasks goes on to take more of them.
+ */
+class WorkerPool {
+  public:
+    /**
+     * @param numThreads The number of threads working on a job, including the thread that calls run().
+     */
+    explicit WorkerPool(const size_t numThreads);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    /**
+     * @return The number of threads working on a job, including the calling one.
+     */
+    size_t size() const {
+      return mWorkers.size() + 1;
+    }
+
+    /**
+     * Calls 'task(i, thread)' for every i in [0, numTasks) and returns when all calls are done.
+     * 'thread' is in [0, size()) and unique among the calls running at the same time, so that it can index per-thread scratch memory.
+     * Tasks must not throw. Only one job runs at a time.
+     * @param numTasks
+     * @param task
+     */
+    void run(const size_t numTasks, const std::function<void(size_t, size_t)>& task);
+
+  private:
+    void work(const size_t thread);
+    void claimTasks(const size_t thread);
+
+    std::vector<std::thread> mWorkers;
+    std::mutex mMutex;
+    std::condition_variable mJobStarted, mJobDone;
+    /**
+     * Incremented for each job, so that workers notice a new one.
+     */
+    unsigned long mJob;
+    /**
+     * The number of workers still busy with the current job.
+     */
+    size_t mNumBusy;
+    bool mStopping;
+
+    const std::function<void(size_t, size_t)>* mTask;
+    size_t mNumTasks;
+    std::atomic<size_t> mNextTask;
+};
+
+#endif //SCHEDULER_WORKERPOOL_HPP
@@ -0,0 +1,79 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <thread>
+#include "MaxDatarateSorter.hpp"
+#include "WorkerPool.hpp"
+
+using namespace std;
+
+/**
+ * Measures how BandSorter::finalize() scales with the number of threads of a WorkerPool,
+ * and checks that every thread count gives the same lists as sorting serially.
+ * Usage: finalize_benchmark [numBands] [numNodes] [numRepetitions] [maxThreads]
+ */
+
+namespace {
+  void fill(MaxDatarateSorter& sorter, const size_t numBands, const size_t numNodes, const unsigned seed) {
+    mt19937 random(seed);
+    uniform_int_distribution<int> rate(0, 1000);
+    sorter.clear();
+    for (Band band = 0; band < numBands; band++)
+      for (size_t node = 0; node < numNodes; node++)
+        sorter.put(band, IdRatePair(MacCid(node), MacNodeId(1025 + node), 1, 26, double(rate(random)), Direction::UL));
+  }
+
+  bool sameLists(const MaxDatarateSorter& a, const MaxDatarateSorter& b, const size_t numBands) {
+    for (Band band = 0; band < numBands; band++) {
+      const vector<IdRatePair>& listA = a.at(band);
+      const vector<IdRatePair>& listB = b.at(band);
+      if (listA.size() != listB.size())
+        return false;
+      for (size_t i = 0; i < listA.size(); i++) {
+        if (listA[i].from != listB[i].from || listA[i].connectionId != listB[i].connectionId
+            || memcmp(&listA[i].rate, &listB[i].rate, sizeof(double)) != 0)
+          return false;
+      }
+    }
+    return true;
+  }
+}
+
+int main(int argc, char** argv) {
+  const size_t numBands = argc > 1 ? size_t(atoi(argv[1])) : 100;
+  const size_t numNodes = argc > 2 ? size_t(atoi(argv[2])) : 2000;
+  const size_t numRepetitions = argc > 3 ? size_t(atoi(argv[3])) : 20;
+  const size_t maxThreads = argc > 4 ? size_t(atoi(argv[4])) : max(1u, thread::hardware_concurrency());
+
+  MaxDatarateSorter reference(numBands, numNodes);
+  fill(reference, numBands, numNodes, 0);
+  reference.finalize();
+
+  cout << numBands << " bands, " << numNodes << " pairs per band, " << numRepetitions << " repetitions" << endl;
+  cout << "threads\tms per finalize\tspeedup\tidentical" << endl;
+  double serialTime = 0;
+  for (size_t numThreads = 1; numThreads <= maxThreads; numThreads++) {
+    WorkerPool pool(numThreads);
+    MaxDatarateSorter sorter(numBands, numNodes);
+    chrono::duration<double, milli> total(0);
+    bool identical = true;
+    for (size_t repetition = 0; repetition < numRepetitions; repetition++) {
+      fill(sorter, numBands, numNodes, 0);
+      const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      sorter.finalize(pool);
+      total += chrono::steady_clock::now() - start;
+      identical = identical && sameLists(reference, sorter, numBands);
+    }
+    const double time = total.count() / numRepetitions;
+    if (numThreads == 1)
+      serialTime = time;
+    cout << numThreads << "\t" << fixed << setprecision(3) << time << "\t" << setprecision(2) << serialTime / time
+         << "\t" << (identical ? "yes" : "NO") << endl;
+    if (!identical)
+      return 1;
+  }
+  return 0;
+}
@@ -4,66 +4,234 @@
 
 #include <stdexcept>
 #include <iostream>
+#include <limits>
+#include <algorithm>
 #include "SchedulingMemory.hpp"
 
 using namespace std;
 
-SchedulingMemory::SchedulingMemory() {}
+const size_t SchedulingMemory::NOT_FOUND = numeric_limits<size_t>::max();
+
+SchedulingMemory::PositionBlock::PositionBlock() {
+  fill(positions, positions + POSITION_BLOCK_SIZE, NOT_FOUND);
+}
+
+SchedulingMemory::SchedulingMemory() : _state(make_shared<State>(1)) {}
+
+SchedulingMemory::SchedulingMemory(const size_t numBands)
+  : _state(make_shared<State>(max(size_t(1), (numBands + BITS_PER_WORD - 1) / BITS_PER_WORD))) {}
 
 SchedulingMemory::SchedulingMemory(const SchedulingMemory &other)
-  : _memory(other._memory) {}
+  : _state(other._state) {}
 
 void SchedulingMemory::put(const MacNodeId id, const Band band, const bool isReassigned) {
-  // Is there an item for 'id' already?
-  try {
-    MemoryItem &item = get(id);
-    item.putBand(band, isReassigned);
-  // If not, create it.
-  } catch (const exception& e) {
-    _memory.push_back(MemoryItem(id));
-    MemoryItem &item = _memory.at(_memory.size() - 1);
-    item.putBand(band, isReassigned);
+  if (band / BITS_PER_WORD >= _state->numWords)
+    widen(band / BITS_PER_WORD + 1);
+  MemoryItem &item = getOrAdd(id);
+  State &state = mutableState();
+  uint64_t *bits = bitsOf(item);
+  const size_t word = band / BITS_PER_WORD;
+  const uint64_t bit = uint64_t(1) << (band % BITS_PER_WORD);
+  if ((bits[word] & bit) == 0) {
+    if (band >= state.holders.size())
+      state.holders.resize(size_t(band) + 1);
+    shared_ptr<vector<MacNodeId>> &holders = state.holders[band];
+    if (!holders)
+      holders = make_shared<vector<MacNodeId>>();
+    else if (holders.use_count() > 1)
+      holders = make_shared<vector<MacNodeId>>(*holders);
+    holders->push_back(id);
+    mutableChunk(item._position / CHUNK_SIZE).assignments.push_back(Assignment(uint16_t(item._position % CHUNK_SIZE), band));
   }
+  bits[word] |= bit;
+  if (isReassigned)
+    bits[state.numWords + word] |= bit;
+  else
+    bits[state.numWords + word] &= ~bit;
+  if (item._position < _lists.size())
+    _lists[item._position].valid = false;
 }
 
 const SchedulingMemory::MemoryItem& SchedulingMemory::get(const MacNodeId &id) const {
-  for (size_t i = 0; i < _memory.size(); i++) {
-    if (_memory.at(i).getId() == id)
-      return _memory.at(i);
-  }
-  throw invalid_argument("SchedulingMemory::get(invalid 'id') was called with id=" + std::to_string(id));
+  const MemoryItem* item = find(id);
+  if (item == nullptr)
+    throw invalid_argument("SchedulingMemory::get(invalid 'id') was called with id=" + std::to_string(id));
+  return *item;
 }
 
 SchedulingMemory::MemoryItem& SchedulingMemory::get(const MacNodeId &id) {
-  // Apparently Scott Meyers recommends doing this. Looks complicated,
-  // but it just casts away the const.
-  return const_cast<MemoryItem&>(static_cast<const SchedulingMemory&>(*this).get(id));
+  MemoryItem* item = find(id);
+  if (item == nullptr)
+    throw invalid_argument("SchedulingMemory::get(invalid 'id') was called with id=" + std::to_string(id));
+  return *item;
+}
+
+const SchedulingMemory::MemoryItem* SchedulingMemory::find(const MacNodeId &id) const {
+  const size_t position = positionOf(id);
+  return position == NOT_FOUND ? nullptr : &itemAt(position);
+}
+
+SchedulingMemory::MemoryItem* SchedulingMemory::find(const MacNodeId &id) {
+  const size_t position = positionOf(id);
+  return position == NOT_FOUND ? nullptr : &mutableChunk(position / CHUNK_SIZE).items[position % CHUNK_SIZE];
+}
+
+SchedulingMemory::MemoryItem& SchedulingMemory::getOrAdd(const MacNodeId &id) {
+  MemoryItem* item = find(id);
+  return item != nullptr ? *item : add(id);
+}
+
+SchedulingMemory::MemoryItem& SchedulingMemory::add(const MacNodeId &id) {
+  State &state = mutableState();
+  const size_t block = id / POSITION_BLOCK_SIZE;
+  if (block >= state.positions.size())
+    state.positions.resize(block + 1);
+  shared_ptr<PositionBlock> &positions = state.positions[block];
+  if (!positions)
+    positions = make_shared<PositionBlock>();
+  else if (positions.use_count() > 1)
+    positions = make_shared<PositionBlock>(*positions);
+  const size_t position = state.numItems++;
+  positions->positions[id % POSITION_BLOCK_SIZE] = position;
+  if (position % CHUNK_SIZE == 0)
+    state.chunks.push_back(make_shared<Chunk>(state.numWords));
+  Chunk &chunk = mutableChunk(position / CHUNK_SIZE);
+  chunk.items.push_back(MemoryItem(id, position));
+  chunk.bits.resize(chunk.bits.size() + 2 * state.numWords, 0);
+  return chunk.items.back();
+}
+
+const SchedulingMemory::MemoryItem& SchedulingMemory::itemAt(const size_t position) const {
+  return _state->chunks[position / CHUNK_SIZE]->items[position % CHUNK_SIZE];
+}
+
+size_t SchedulingMemory::positionOf(const MacNodeId &id) const {
+  const size_t block = id / POSITION_BLOCK_SIZE;
+  if (block >= _state->positions.size() || !_state->positions[block])
+    return NOT_FOUND;
+  return _state->positions[block]->positions[id % POSITION_BLOCK_SIZE];
+}
+
+SchedulingMemory::State& SchedulingMemory::mutableState() {
+  // Only the pointers to chunks, position blocks and holder lists are copied here.
+  if (_state.use_count() > 1)
+    _state = make_shared<State>(*_state);
+  return *_state;
+}
+
+SchedulingMemory::Chunk& SchedulingMemory::mutableChunk(const size_t chunk) {
+  shared_ptr<Chunk> &pointer = mutableState().chunks[chunk];
+  if (pointer.use_count() > 1)
+    pointer = make_shared<Chunk>(*pointer);
+  return *pointer;
+}
+
+const uint64_t* SchedulingMemory::bitsOf(const MemoryItem &item) const {
+  const Chunk &chunk = *_state->chunks[item._position / CHUNK_SIZE];
+  return chunk.bits.data() + (item._position % CHUNK_SIZE) * 2 * _state->numWords;
+}
+
+uint64_t* SchedulingMemory::bitsOf(const MemoryItem &item) {
+  Chunk &chunk = *_state->chunks[item._position / CHUNK_SIZE];
+  return chunk.bits.data() + (item._position % CHUNK_SIZE) * 2 * _state->numWords;
+}
+
+const SchedulingMemory::BandLists& SchedulingMemory::updateLists(const MemoryItem &item) const {
+  if (item._position >= _lists.size())
+    _lists.resize(item._position + 1);
+  BandLists &lists = _lists[item._position];
+  if (lists.valid)
+    return lists;
+  lists.bands.clear();
+  lists.reassigned.clear();
+  const uint64_t *bits = bitsOf(item);
+  const vector<Assignment> &assignments = _state->chunks[item._position / CHUNK_SIZE]->assignments;
+  const size_t slot = item._position % CHUNK_SIZE;
+  for (size_t i = 0; i < assignments.size(); i++) {
+    if (assignments[i].slot != slot)
+      continue;
+    const Band band = assignments[i].band;
+    lists.bands.push_back(band);
+    lists.reassigned.push_back((bits[_state->numWords + band / BITS_PER_WORD] >> (band % BITS_PER_WORD)) & 1);
+  }
+  lists.valid = true;
+  return lists;
+}
+
+void SchedulingMemory::widen(const size_t numWords) {
+  State &state = mutableState();
+  for (size_t i = 0; i < state.chunks.size(); i++) {
+    Chunk &chunk = mutableChunk(i);
+    vector<uint64_t> bits;
+    bits.reserve(CHUNK_SIZE * 2 * numWords);
+    bits.resize(chunk.items.size() * 2 * numWords, 0);
+    for (size_t j = 0; j < chunk.items.size(); j++) {
+      const vector<uint64_t>::const_iterator row = chunk.bits.begin() + j * 2 * state.numWords;
+      copy(row, row + state.numWords, bits.begin() + j * 2 * numWords);
+      copy(row + state.numWords, row + 2 * state.numWords, bits.begin() + j * 2 * numWords + numWords);
+    }
+    chunk.bits.swap(bits);
+  }
+  state.numWords = numWords;
 }
 
 std::size_t SchedulingMemory::getNumberAssignedBands(const MacNodeId &id) const {
-  return get(id).getNumberOfAssignedBands();
+  const uint64_t *bits = bitsOf(get(id));
+  size_t count = 0;
+  for (size_t i = 0; i < _state->numWords; i++)
+    count += size_t(__builtin_popcountll(bits[i]));
+  return count;
 }
 
 const std::vector<Band>& SchedulingMemory::getBands(const MacNodeId &id) const {
-  return get(id).getBands();
+  return updateLists(get(id)).bands;
 }
 const std::vector<bool>& SchedulingMemory::getReassignments(const MacNodeId &id) const {
-  return get(id).getReassignments();
+  return updateLists(get(id)).reassigned;
 }
 
-void SchedulingMemory::put(const MacNodeId id, const Direction dir) {
-  // Is there an item for 'id' already?
-  try {
-    MemoryItem &item = get(id);
-    item.setDir(dir);
-    // If not, create it.
-  } catch (const exception& e) {
-    _memory.push_back(MemoryItem(id));
-    MemoryItem &item = _memory.at(_memory.size() - 1);
-    item.setDir(dir);
+bool SchedulingMemory::isAssigned(const MacNodeId &id, const Band band) const {
+  const uint64_t *bits = bitsOf(get(id));
+  return band / BITS_PER_WORD < _state->numWords && (bits[band / BITS_PER_WORD] >> (band % BITS_PER_WORD)) & 1;
+}
+
+bool SchedulingMemory::isReassigned(const MacNodeId &id, const Band band) const {
+  const uint64_t *bits = bitsOf(get(id));
+  return band / BITS_PER_WORD < _state->numWords
+         && (bits[_state->numWords + band / BITS_PER_WORD] >> (band % BITS_PER_WORD)) & 1;
+}
+
+std::vector<Band> SchedulingMemory::getSharedBands(const MacNodeId &id1, const MacNodeId &id2) const {
+  const uint64_t *bits1 = bitsOf(get(id1)), *bits2 = bitsOf(get(id2));
+  vector<Band> shared;
+  for (size_t i = 0; i < _state->numWords; i++) {
+    for (uint64_t bits = bits1[i] & bits2[i]; bits != 0; bits &= bits - 1)
+      shared.push_back(Band(i * BITS_PER_WORD + size_t(__builtin_ctzll(bits))));
   }
+  return shared;
+}
+
+void SchedulingMemory::put(const MacNodeId id, const Direction dir) {
+  getOrAdd(id).setDir(dir);
 }
 
 const Direction &SchedulingMemory::getDirection(const MacNodeId &id) const {
   return get(id).getDir();
 }
+
+bool SchedulingMemory::contains(const MacNodeId &id) const {
+  return find(id) != nullptr;
+}
+
+std::size_t SchedulingMemory::size() const {
+  return _state->numItems;
+}
+
+const std::vector<MacNodeId>& SchedulingMemory::getHolders(const Band band) const {
+  static const vector<MacNodeId> noHolders;
+  return band < _state->holders.size() && _state->holders[band] ? *_state->holders[band] : noHolders;
+}
+
+std::size_t SchedulingMemory::getReuseCount(const Band band) const {
+  return band < _state->holders.size() && _state->holders[band] ? _state->holders[band]->size() : 0;
+}
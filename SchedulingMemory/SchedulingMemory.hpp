@@ -5,6 +5,10 @@
 #ifndef SCHEDULINGMEMORY_SCHEDULINGMEMORY_HPP
 #define SCHEDULINGMEMORY_SCHEDULINGMEMORY_HPP
 
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
 #include <vector>
 
 typedef unsigned short MacNodeId;
@@ -15,14 +19,36 @@ enum Direction {
 
 /**
  * Maps a node id to its assigned bands and transmission direction.
+ * A node's bands are kept as one bit per band, so each band is assigned at most once.
+ * Copies are cheap, so a copy can be kept per TTI as a snapshot of the assignments.
+ *
+ * Items are kept in chunks of CHUNK_SIZE, each with the bits of its items in one block, and ids are looked up
+ * through blocks of POSITION_BLOCK_SIZE positions. Copies share chunks and blocks until one of them writes.
+ * The first write after a copy still copies the tables of pointers to them, one per chunk, per block
+ * of ids and per band, and then the chunk and block it writes to. So a TTI's writes cost O(nodes / CHUNK_SIZE + bands)
+ * plus a chunk per node written to, instead of O(nodes). Putting a band beyond the current width copies all chunks.
+ *
+ * Different copies can be used on different threads. One SchedulingMemory must not be read on several threads
+ * at once, though, as getBands() and getReassignments() fill its vectors on first use.
  */
 class SchedulingMemory {
   public:
     
     SchedulingMemory();
+    /**
+     * @param numBands The number of bands to make room for. Putting a higher band is still possible,
+     * but widens every node's bits.
+     */
+    explicit SchedulingMemory(const std::size_t numBands);
+    /**
+     * Shares the other memory's items instead of copying them, so that this takes constant time.
+     * Either memory copies an item when it is written to, the other one doesn't see the change.
+     * @param other
+     */
     SchedulingMemory(const SchedulingMemory& other);
     /**
      * Notify a 'band' being assigned to 'id'.
+     * If it already was, only its reassignment flag is set to 'isReassigned', so the last put decides it.
      * @param id
      * @param band
      * @param isReassigned
@@ -42,33 +68,82 @@ class SchedulingMemory {
      */
     std::size_t getNumberAssignedBands(const MacNodeId& id) const;
     
+    /**
+     * @param id
+     * @return The bands assigned to 'id' in the order they were first assigned.
+     */
     const std::vector<Band>& getBands(const MacNodeId& id) const;
+    /**
+     * @param id
+     * @return Whether each of getBands(id) was reassigned.
+     */
     const std::vector<bool>& getReassignments(const MacNodeId& id) const;
     
+    /**
+     * @param id
+     * @param band
+     * @return Whether 'band' is assigned to 'id'.
+     */
+    bool isAssigned(const MacNodeId& id, const Band band) const;
+    
+    /**
+     * @param id
+     * @param band
+     * @return Whether 'band' is assigned to 'id' and was reassigned.
+     */
+    bool isReassigned(const MacNodeId& id, const Band band) const;
+    
+    /**
+     * @param id1
+     * @param id2
+     * @return The bands assigned to both 'id1' and 'id2' in ascending order.
+     */
+    std::vector<Band> getSharedBands(const MacNodeId& id1, const MacNodeId& id2) const;
+    
+    /**
+     * @param band
+     * @return The nodes 'band' is assigned to, in the order they were assigned it.
+     */
+    const std::vector<MacNodeId>& getHolders(const Band band) const;
+    
+    /**
+     * @param band
+     * @return The number of nodes 'band' is assigned to.
+     */
+    std::size_t getReuseCount(const Band band) const;
+    
     const Direction& getDirection(const MacNodeId& id) const;
     
+    /**
+     * @param id
+     * @return Whether a band or direction has been put for 'id'.
+     */
+    bool contains(const MacNodeId& id) const;
+    
+    /**
+     * @return The number of nodes a band or direction has been put for.
+     */
+    std::size_t size() const;
+    
+    /**
+     * Calls 'function' with each node's id, in the order the nodes were first put, so that history dumps keep a stable order.
+     * @param function Called as 'function(const MacNodeId&)'.
+     */
+    template <class Function>
+    void forEach(Function function) const {
+      for (std::size_t position = 0; position < _state->numItems; position++)
+        function(itemAt(position).getId());
+    }
+    
   private:
     /**
-     * A memory item holds the assigned bands per node id
+     * A memory item holds the assigned bands of a node id
      * as well as the transmission direction this node wants to transmit in.
+     * The bands are bits in the item's chunk.
      */
     class MemoryItem {
       public:
-        MemoryItem(MacNodeId id) : _id(id), _dir(UNKNOWN_DIRECTION) {}
-        
-        void putBand(Band band, bool reassigned) {
-          _assignedBands.push_back(band);
-          _reassigned.push_back(reassigned);
-        }
-        std::size_t getNumberOfAssignedBands() const {
-          return _assignedBands.size();
-        }
-        const std::vector<Band>& getBands() const {
-          return _assignedBands;
-        }
-        const std::vector<bool>& getReassignments() const {
-          return _reassigned;
-        }
+        MemoryItem(MacNodeId id, std::size_t position) : _id(id), _dir(UNKNOWN_DIRECTION), _position(position) {}
         
         void setDir(Direction dir) {
           _dir = dir;
@@ -82,17 +157,201 @@ class SchedulingMemory {
         }
       
       private:
+        // Finds the item's bits.
+        friend class SchedulingMemory;
+        
         MacNodeId _id;
-        std::vector<Band> _assignedBands;
-        std::vector<bool> _reassigned;
         Direction _dir;
+        /**
+         * The item's position in the order items were added.
+         */
+        std::size_t _position;
+    };
+    
+    /**
+     * A node's assigned bands and their reassignment flags as vectors, valid if 'valid'.
+     */
+    class BandLists {
+      public:
+        BandLists() : valid(false) {}
+        
+        std::vector<Band> bands;
+        std::vector<bool> reassigned;
+        bool valid;
+    };
+    
+    static const std::size_t CHUNK_SIZE = 64;
+    static const std::size_t POSITION_BLOCK_SIZE = 256;
+    
+    /**
+     * A band being assigned to the item in a chunk's slot for the first time.
+     */
+    class Assignment {
+      public:
+        Assignment(uint16_t slot, Band band) : slot(slot), band(band) {}
+        
+        uint16_t slot;
+        Band band;
+    };
+    
+    /**
+     * Up to CHUNK_SIZE consecutive items and their bits. Memory for all of them is reserved up front,
+     * so that adding an item doesn't move the others.
+     */
+    class Chunk {
+      public:
+        explicit Chunk(std::size_t numWords) {
+          items.reserve(CHUNK_SIZE);
+          bits.reserve(CHUNK_SIZE * 2 * numWords);
+        }
+        Chunk(const Chunk& other) : bits(other.bits), assignments(other.assignments) {
+          items.reserve(CHUNK_SIZE);
+          items.insert(items.end(), other.items.begin(), other.items.end());
+        }
+        
+        std::vector<MemoryItem> items;
+        /**
+         * Per item a row of its assigned bands' bits followed by its reassigned bands' bits, in 'numWords' words each.
+         * Bit 'band % BITS_PER_WORD' of word 'band / BITS_PER_WORD' stands for 'band'.
+         */
+        std::vector<uint64_t> bits;
+        /**
+         * The bands assigned to the chunk's items, in the order they were first assigned.
+         * Shared by all items of the chunk, so that no item needs a list of its own.
+         */
+        std::vector<Assignment> assignments;
+    };
+    
+    /**
+     * The positions of the items for POSITION_BLOCK_SIZE consecutive node ids, or NOT_FOUND.
+     */
+    class PositionBlock {
+      public:
+        PositionBlock();
+        
+        std::size_t positions[POSITION_BLOCK_SIZE];
+    };
+    
+    /**
+     * Everything copies of a SchedulingMemory share until one of them is written to.
+     * Chunks, position blocks and holder lists are shared on their own, so that writing copies only those that change.
+     */
+    class State {
+      public:
+        explicit State(std::size_t numWords) : numItems(0), numWords(numWords) {}
+        
+        /**
+         * Items in the order their node ids were first put, item 'i' is in chunk 'i / CHUNK_SIZE'.
+         */
+        std::vector<std::shared_ptr<Chunk>> chunks;
+        std::size_t numItems;
+        /**
+         * The position of the item for 'id' is in block 'id / POSITION_BLOCK_SIZE' at 'id % POSITION_BLOCK_SIZE'.
+         * Blocks without any item are nullptr, blocks beyond its size as well.
+         */
+        std::vector<std::shared_ptr<PositionBlock>> positions;
+        /**
+         * The number of words per item for either assigned or reassigned bands.
+         */
+        std::size_t numWords;
+        /**
+         * 'holders[band]' holds the nodes 'band' is assigned to, or is nullptr if there are none.
+         * Bands beyond its size aren't assigned to any node.
+         */
+        std::vector<std::shared_ptr<std::vector<MacNodeId>>> holders;
     };
     
   protected:
     const MemoryItem& get(const MacNodeId& id) const;
+    /**
+     * @param id
+     * @return The item for 'id', copied first if it is shared with another SchedulingMemory.
+     */
     MemoryItem& get(const MacNodeId& id);
     
-    std::vector<MemoryItem> _memory;
+    /**
+     * @param id
+     * @return The item for 'id', or nullptr if there is none.
+     */
+    const MemoryItem* find(const MacNodeId& id) const;
+    /**
+     * @param id
+     * @return The item for 'id', copied first if it is shared with another SchedulingMemory, or nullptr if there is none.
+     */
+    MemoryItem* find(const MacNodeId& id);
+    
+    /**
+     * @param id
+     * @return The item for 'id', which is added if there is none yet.
+     */
+    MemoryItem& getOrAdd(const MacNodeId& id);
+    
+    /**
+     * Appends an item for 'id', which must not have one yet.
+     * @param id
+     * @return The new item.
+     */
+    MemoryItem& add(const MacNodeId& id);
+    
+    /**
+     * @param position Less than size().
+     * @return The item at 'position' in the order items were added.
+     */
+    const MemoryItem& itemAt(const std::size_t position) const;
+    
+  private:
+    /**
+     * @param id
+     * @return The position of the item for 'id' in the state's items, or NOT_FOUND.
+     */
+    std::size_t positionOf(const MacNodeId& id) const;
+    
+    /**
+     * Copies the state if it is shared with another SchedulingMemory.
+     * @return The state, now only held by this one.
+     */
+    State& mutableState();
+    
+    /**
+     * @param chunk
+     * @return The chunk at 'chunk' in the state's chunks, copied first if it is shared with another SchedulingMemory.
+     */
+    Chunk& mutableChunk(const std::size_t chunk);
+    
+    /**
+     * @param item
+     * @return The item's row of bits.
+     */
+    const uint64_t* bitsOf(const MemoryItem& item) const;
+    /**
+     * @param item An item that is only held by this SchedulingMemory, as returned by the non-const get().
+     * @return The item's row of bits.
+     */
+    uint64_t* bitsOf(const MemoryItem& item);
+    
+    /**
+     * Fills the item's band vectors from its bits, if they are outdated.
+     * @param item
+     * @return The item's band vectors.
+     */
+    const BandLists& updateLists(const MemoryItem& item) const;
+    
+    /**
+     * Gives every item 'numWords' words for either assigned or reassigned bands. Copies every chunk.
+     * @param numWords
+     */
+    void widen(const std::size_t numWords);
+    
+    static const std::size_t BITS_PER_WORD = 64;
+    static const std::size_t NOT_FOUND;
+    
+    std::shared_ptr<State> _state;
+    /**
+     * Per item position the vectors handed out by getBands() and getReassignments(). They are kept per copy
+     * instead of in the shared chunks, so that reading one copy doesn't write to what another one reads.
+     * A deque, so that growing it doesn't move vectors already handed out. Copies start without any.
+     */
+    mutable std::deque<BandLists> _lists;
 };
 
 
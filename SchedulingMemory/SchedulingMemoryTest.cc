@@ -1,6 +1,7 @@
 #include <cppunit/TestFixture.h>
 #include <cppunit/extensions/HelperMacros.h>
 #include <iostream>
+#include <thread>
 #include "SchedulingMemory.hpp"
 
 using namespace std;
@@ -64,9 +65,243 @@ class SchedulingMemoryTest : public CppUnit::TestFixture {
       CPPUNIT_ASSERT_EQUAL(true, assignments.at(1));
     }
   
+    void testManyNodes() {
+      cout << "[SchedulingMemoryTest/testManyNodes]" << endl;
+      // Ids below the first one put and with gaps in between.
+      for (MacNodeId id = 1100; id < 1200; id += 3)
+        memory->put(id, Band(id % 7), false);
+      for (MacNodeId id = 1099; id >= 1025; id -= 2)
+        memory->put(id, DL);
+      memory->put(MacNodeId(1), UL);
+      for (MacNodeId id = 1100; id < 1200; id += 3) {
+        CPPUNIT_ASSERT_EQUAL(size_t(1), memory->getNumberAssignedBands(id));
+        CPPUNIT_ASSERT_EQUAL(Band(id % 7), memory->getBands(id).at(0));
+        CPPUNIT_ASSERT_EQUAL(UNKNOWN_DIRECTION, memory->getDirection(id));
+      }
+      for (MacNodeId id = 1099; id >= 1025; id -= 2)
+        CPPUNIT_ASSERT_EQUAL(DL, memory->getDirection(id));
+      CPPUNIT_ASSERT_EQUAL(UL, memory->getDirection(MacNodeId(1)));
+      SchedulingMemory copy(*memory);
+      CPPUNIT_ASSERT_EQUAL(Band(1103 % 7), copy.getBands(MacNodeId(1103)).at(0));
+      const MacNodeId unknownIds[] = {0, 2, 1024, 1098, 1101, 1200, 65535};
+      for (size_t i = 0; i < sizeof(unknownIds) / sizeof(unknownIds[0]); i++) {
+        bool exceptionOccurred = false;
+        try {
+          copy.getDirection(unknownIds[i]);
+        } catch (const invalid_argument& e) {
+          exceptionOccurred = true;
+        }
+        CPPUNIT_ASSERT_EQUAL(true, exceptionOccurred);
+      }
+    }
+  
+    void testContains() {
+      cout << "[SchedulingMemoryTest/testContains]" << endl;
+      MacNodeId id1 = MacNodeId(1025), id2 = MacNodeId(1026);
+      CPPUNIT_ASSERT_EQUAL(false, memory->contains(id1));
+      memory->put(id1, Band(0), false);
+      memory->put(id2, D2D);
+      CPPUNIT_ASSERT_EQUAL(true, memory->contains(id1));
+      CPPUNIT_ASSERT_EQUAL(true, memory->contains(id2));
+      CPPUNIT_ASSERT_EQUAL(false, memory->contains(MacNodeId(1027)));
+      // Putting again updates the existing items.
+      memory->put(id1, UL);
+      memory->put(id2, Band(3), true);
+      CPPUNIT_ASSERT_EQUAL(size_t(1), memory->getNumberAssignedBands(id1));
+      CPPUNIT_ASSERT_EQUAL(UL, memory->getDirection(id1));
+      CPPUNIT_ASSERT_EQUAL(D2D, memory->getDirection(id2));
+      CPPUNIT_ASSERT_EQUAL(Band(3), memory->getBands(id2).at(0));
+      CPPUNIT_ASSERT_EQUAL(true, memory->getReassignments(id2).at(0));
+    }
+  
+    void testBandBits() {
+      cout << "[SchedulingMemoryTest/testBandBits]" << endl;
+      MacNodeId id1 = MacNodeId(1025), id2 = MacNodeId(1026);
+      memory->put(id1, Band(5), false);
+      memory->put(id1, Band(2), true);
+      memory->put(id2, Band(2), false);
+      CPPUNIT_ASSERT_EQUAL(size_t(2), memory->getBands(id1).size());
+      // Assigning a band again only updates its flag, and a higher band widens every node's bits.
+      memory->put(id1, Band(5), true);
+      memory->put(id1, Band(70), false);
+      memory->put(id2, Band(70), true);
+      CPPUNIT_ASSERT_EQUAL(size_t(3), memory->getNumberAssignedBands(id1));
+      const vector<Band>& bands = memory->getBands(id1);
+      const vector<bool>& reassignments = memory->getReassignments(id1);
+      CPPUNIT_ASSERT_EQUAL(size_t(3), bands.size());
+      // In the order the bands were first assigned.
+      CPPUNIT_ASSERT_EQUAL(Band(5), bands.at(0));
+      CPPUNIT_ASSERT_EQUAL(Band(2), bands.at(1));
+      CPPUNIT_ASSERT_EQUAL(Band(70), bands.at(2));
+      CPPUNIT_ASSERT_EQUAL(true, bool(reassignments.at(0)));
+      CPPUNIT_ASSERT_EQUAL(true, bool(reassignments.at(1)));
+      CPPUNIT_ASSERT_EQUAL(false, bool(reassignments.at(2)));
+      CPPUNIT_ASSERT_EQUAL(true, memory->isAssigned(id1, Band(70)));
+      CPPUNIT_ASSERT_EQUAL(false, memory->isAssigned(id1, Band(3)));
+      CPPUNIT_ASSERT_EQUAL(false, memory->isAssigned(id1, Band(1000)));
+      CPPUNIT_ASSERT_EQUAL(true, memory->isReassigned(id2, Band(70)));
+      CPPUNIT_ASSERT_EQUAL(false, memory->isReassigned(id2, Band(2)));
+      // The last put decides the flag, also when it clears it.
+      memory->put(id1, Band(2), false);
+      CPPUNIT_ASSERT_EQUAL(false, memory->isReassigned(id1, Band(2)));
+      CPPUNIT_ASSERT_EQUAL(false, bool(memory->getReassignments(id1).at(1)));
+      CPPUNIT_ASSERT_EQUAL(Band(2), memory->getBands(id1).at(1));
+      
+      SchedulingMemory copy(*memory);
+      const vector<Band> shared = copy.getSharedBands(id1, id2);
+      CPPUNIT_ASSERT_EQUAL(size_t(2), shared.size());
+      CPPUNIT_ASSERT_EQUAL(Band(2), shared.at(0));
+      CPPUNIT_ASSERT_EQUAL(Band(70), shared.at(1));
+      CPPUNIT_ASSERT_EQUAL(size_t(2), copy.getBands(id2).size());
+    }
+  
+    void testHolders() {
+      cout << "[SchedulingMemoryTest/testHolders]" << endl;
+      MacNodeId id1 = MacNodeId(1025), id2 = MacNodeId(1026), id3 = MacNodeId(1027);
+      CPPUNIT_ASSERT_EQUAL(size_t(0), memory->getReuseCount(Band(3)));
+      CPPUNIT_ASSERT_EQUAL(true, memory->getHolders(Band(3)).empty());
+      memory->put(id2, Band(3), false);
+      memory->put(id1, Band(3), true);
+      memory->put(id3, Band(1), false);
+      // Assigning a band again doesn't count twice.
+      memory->put(id2, Band(3), true);
+      CPPUNIT_ASSERT_EQUAL(size_t(2), memory->getReuseCount(Band(3)));
+      CPPUNIT_ASSERT_EQUAL(size_t(1), memory->getReuseCount(Band(1)));
+      CPPUNIT_ASSERT_EQUAL(size_t(0), memory->getReuseCount(Band(2)));
+      const vector<MacNodeId>& holders = memory->getHolders(Band(3));
+      CPPUNIT_ASSERT_EQUAL(size_t(2), holders.size());
+      CPPUNIT_ASSERT_EQUAL(id2, holders.at(0));
+      CPPUNIT_ASSERT_EQUAL(id1, holders.at(1));
+      SchedulingMemory copy(*memory);
+      CPPUNIT_ASSERT_EQUAL(id3, copy.getHolders(Band(1)).at(0));
+    }
+  
+    void testSnapshots() {
+      cout << "[SchedulingMemoryTest/testSnapshots]" << endl;
+      MacNodeId id1 = MacNodeId(1025), id2 = MacNodeId(1026), id3 = MacNodeId(1027);
+      memory->put(id1, Band(0), false);
+      memory->put(id2, Band(0), false);
+      memory->put(id2, UL);
+      SchedulingMemory snapshot(*memory);
+      const vector<Band>& snapshotBands = snapshot.getBands(id1);
+      // Changing the memory leaves the snapshot as it was, also when that needs wider bits.
+      memory->put(id1, Band(1), true);
+      memory->put(id1, Band(100), false);
+      memory->put(id2, DL);
+      memory->put(id3, Band(0), false);
+      SchedulingMemory nextSnapshot(*memory);
+      memory->put(id3, Band(2), false);
+      
+      CPPUNIT_ASSERT_EQUAL(size_t(1), snapshotBands.size());
+      CPPUNIT_ASSERT_EQUAL(size_t(1), snapshot.getNumberAssignedBands(id1));
+      CPPUNIT_ASSERT_EQUAL(false, snapshot.isAssigned(id1, Band(100)));
+      CPPUNIT_ASSERT_EQUAL(UL, snapshot.getDirection(id2));
+      CPPUNIT_ASSERT_EQUAL(false, snapshot.contains(id3));
+      CPPUNIT_ASSERT_EQUAL(size_t(2), snapshot.getReuseCount(Band(0)));
+      CPPUNIT_ASSERT_EQUAL(size_t(0), snapshot.getReuseCount(Band(1)));
+      
+      CPPUNIT_ASSERT_EQUAL(size_t(3), nextSnapshot.getNumberAssignedBands(id1));
+      CPPUNIT_ASSERT_EQUAL(size_t(1), nextSnapshot.getNumberAssignedBands(id3));
+      CPPUNIT_ASSERT_EQUAL(size_t(0), nextSnapshot.getReuseCount(Band(2)));
+      CPPUNIT_ASSERT_EQUAL(size_t(3), nextSnapshot.getReuseCount(Band(0)));
+      
+      CPPUNIT_ASSERT_EQUAL(size_t(3), memory->getNumberAssignedBands(id1));
+      CPPUNIT_ASSERT_EQUAL(true, memory->isReassigned(id1, Band(1)));
+      CPPUNIT_ASSERT_EQUAL(DL, memory->getDirection(id2));
+      CPPUNIT_ASSERT_EQUAL(size_t(2), memory->getNumberAssignedBands(id3));
+      CPPUNIT_ASSERT_EQUAL(id3, memory->getHolders(Band(2)).at(0));
+      // Writing to a snapshot doesn't change the memory either.
+      snapshot.put(id1, Band(3), false);
+      CPPUNIT_ASSERT_EQUAL(false, memory->isAssigned(id1, Band(3)));
+      CPPUNIT_ASSERT_EQUAL(size_t(0), nextSnapshot.getReuseCount(Band(3)));
+    }
+  
+    void testSnapshotsOfManyNodes() {
+      cout << "[SchedulingMemoryTest/testSnapshotsOfManyNodes]" << endl;
+      // More nodes than fit into one chunk, with ids spread over several blocks.
+      for (MacNodeId id = 1025; id < 1625; id += 2)
+        memory->put(id, Band(id % 13), id % 3 == 0);
+      SchedulingMemory snapshot(*memory);
+      const vector<Band>& snapshotBands = snapshot.getBands(MacNodeId(1025));
+      memory->put(MacNodeId(1025), Band(40), false);
+      memory->put(MacNodeId(1027), Band(40), false);
+      memory->put(MacNodeId(1601), Band(200), true);
+      memory->put(MacNodeId(1026), UL);
+      CPPUNIT_ASSERT_EQUAL(size_t(1), snapshotBands.size());
+      CPPUNIT_ASSERT_EQUAL(false, snapshot.contains(MacNodeId(1026)));
+      CPPUNIT_ASSERT_EQUAL(size_t(0), snapshot.getReuseCount(Band(40)));
+      CPPUNIT_ASSERT_EQUAL(size_t(2), memory->getReuseCount(Band(40)));
+      CPPUNIT_ASSERT_EQUAL(true, memory->isReassigned(MacNodeId(1601), Band(200)));
+      for (MacNodeId id = 1025; id < 1625; id += 2) {
+        CPPUNIT_ASSERT_EQUAL(size_t(1), snapshot.getNumberAssignedBands(id));
+        CPPUNIT_ASSERT_EQUAL(Band(id % 13), snapshot.getBands(id).at(0));
+        CPPUNIT_ASSERT_EQUAL(id % 3 == 0, snapshot.isReassigned(id, Band(id % 13)));
+        CPPUNIT_ASSERT_EQUAL(id % 3 == 0, memory->isReassigned(id, Band(id % 13)));
+      }
+    }
+  
+    void testForEach() {
+      cout << "[SchedulingMemoryTest/testForEach]" << endl;
+      // Put order, not id order, also beyond one chunk and across snapshots.
+      vector<MacNodeId> ids;
+      for (MacNodeId id = 1200; id > 1000; id -= 3)
+        ids.push_back(id);
+      ids.push_back(MacNodeId(7));
+      ids.push_back(MacNodeId(60000));
+      for (size_t i = 0; i < ids.size(); i++) {
+        if (i % 2 == 0)
+          memory->put(ids[i], Band(i % 5), false);
+        else
+          memory->put(ids[i], DL);
+      }
+      SchedulingMemory snapshot(*memory);
+      memory->put(ids[0], Band(3), true);
+      memory->put(MacNodeId(1201), UL);
+      vector<MacNodeId> visited;
+      snapshot.forEach([&visited](const MacNodeId& id) { visited.push_back(id); });
+      CPPUNIT_ASSERT_EQUAL(ids.size(), snapshot.size());
+      CPPUNIT_ASSERT(ids == visited);
+      visited.clear();
+      memory->forEach([&visited](const MacNodeId& id) { visited.push_back(id); });
+      ids.push_back(MacNodeId(1201));
+      CPPUNIT_ASSERT_EQUAL(ids.size(), memory->size());
+      CPPUNIT_ASSERT(ids == visited);
+    }
+  
+    void testConcurrentCopies() {
+      cout << "[SchedulingMemoryTest/testConcurrentCopies]" << endl;
+      for (MacNodeId id = 1025; id < 1125; id++) {
+        memory->put(id, Band(id % 5), false);
+        memory->put(id, Band(id % 7 + 5), id % 2 == 0);
+      }
+      // A snapshot and the memory it was copied from read the same items on two threads.
+      SchedulingMemory snapshot(*memory);
+      bool snapshotConsistent = true;
+      thread reader([&snapshot, &snapshotConsistent]() {
+        for (int round = 0; round < 20; round++)
+          for (MacNodeId id = 1025; id < 1125; id++)
+            snapshotConsistent = snapshotConsistent && snapshot.getBands(id).size() == 2 && snapshot.getReassignments(id).at(1) == (id % 2 == 0);
+      });
+      bool consistent = true;
+      for (int round = 0; round < 20; round++)
+        for (MacNodeId id = 1025; id < 1125; id++)
+          consistent = consistent && memory->getBands(id).size() == 2 && memory->getReassignments(id).at(1) == (id % 2 == 0);
+      reader.join();
+      CPPUNIT_ASSERT_EQUAL(true, snapshotConsistent);
+      CPPUNIT_ASSERT_EQUAL(true, consistent);
+    }
+  
   CPPUNIT_TEST_SUITE(SchedulingMemoryTest);
       CPPUNIT_TEST(testPut);
       CPPUNIT_TEST(testCopyConstructor);
       CPPUNIT_TEST(testReassignment);
+      CPPUNIT_TEST(testManyNodes);
+      CPPUNIT_TEST(testContains);
+      CPPUNIT_TEST(testBandBits);
+      CPPUNIT_TEST(testHolders);
+      CPPUNIT_TEST(testSnapshots);
+      CPPUNIT_TEST(testSnapshotsOfManyNodes);
+      CPPUNIT_TEST(testForEach);
+      CPPUNIT_TEST(testConcurrentCopies);
     CPPUNIT_TEST_SUITE_END();
 };